@@ -0,0 +1,98 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Mock of the parts of the Arduino core used by the firmware.
+// Time is taken from the simulator's virtual clock.
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/types.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define INPUT_PULLDOWN 0x09
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+void randomSeed(unsigned long seed);
+long random(long max);
+long random(long min, long max);
+
+char *itoa(int value, char *str, int base);
+
+class IPAddress
+{
+    uint8_t m_octets[4];
+
+public:
+    IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : m_octets{a, b, c, d} {};
+
+    std::string toString() const;
+
+    // the octets as they're laid out in memory, i.e. in network byte order
+    operator uint32_t() const
+    {
+        uint32_t address;
+        memcpy(&address, m_octets, sizeof(address));
+        return address;
+    }
+};
+
+// Serial port which writes to stderr with `-v`. It sends instantly so its buffer is always empty.
+class HardwareSerial
+{
+    size_t m_tx_buffer_size;
+
+    void write_str(const char *s);
+
+public:
+    // the UART's FIFO is all there is until a buffer is set up
+    HardwareSerial() : m_tx_buffer_size(128){};
+
+    size_t setTxBufferSize(size_t size);
+    void begin(unsigned long baud);
+    int availableForWrite();
+    size_t write(const uint8_t *buffer, size_t size);
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(unsigned char n);
+    size_t print(int n);
+    size_t print(unsigned int n);
+    size_t print(long n);
+    size_t print(unsigned long n);
+    size_t print(double n);
+    size_t print(const IPAddress &ip);
+
+    size_t println();
+    template <typename T>
+    size_t println(const T &value)
+    {
+        auto n = print(value);
+        return n + println();
+    }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// In-memory EEPROM. Erased cells read as 0xFF, just like the flash backed one.
+class EEPROMClass
+{
+    std::vector<uint8_t> m_data;
+    size_t m_commits;
+
+public:
+    EEPROMClass() : m_commits(0){};
+
+    bool begin(size_t size);
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    bool commit();
+    uint8_t *getDataPtr();
+    size_t length();
+
+    size_t commits() const
+    {
+        return m_commits;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
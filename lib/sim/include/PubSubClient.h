@@ -0,0 +1,46 @@
+#ifndef PubSubClient_h
+#define PubSubClient_h
+
+#include <functional>
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define MQTT_MAX_PACKET_SIZE 256
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+// Client for the simulator's in-process broker.
+// Messages are only delivered from within `loop`, just like the real client.
+class PubSubClient
+{
+    MQTT_CALLBACK_SIGNATURE;
+    bool m_connected;
+    uint8_t m_buffer[MQTT_MAX_PACKET_SIZE];
+
+public:
+    PubSubClient(WiFiClient &client) : m_connected(false){};
+
+    PubSubClient &setServer(const char *domain, uint16_t port);
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+    PubSubClient &setSocketTimeout(uint16_t timeout)
+    {
+        return *this;
+    }
+
+    boolean connect(const char *id);
+    boolean connect(const char *id, const char *willTopic, uint8_t willQos, boolean willRetain, const char *willMessage);
+    void disconnect();
+    boolean connected();
+
+    boolean subscribe(const char *topic);
+
+    boolean publish(const char *topic, const char *payload);
+    boolean publish(const char *topic, const char *payload, boolean retained);
+    boolean publish(const char *topic, const uint8_t *payload, unsigned int plength);
+    boolean publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained);
+
+    boolean loop();
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef WiFi_h
+#define WiFi_h
+
+#include <Arduino.h>
+
+typedef enum
+{
+    WL_NO_SHIELD = 255,
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_SCAN_COMPLETED = 2,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_CONNECTION_LOST = 5,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+// The simulated access point accepts every connection attempt immediately.
+class WiFiClass
+{
+    wl_status_t m_status;
+
+public:
+    WiFiClass() : m_status(WL_DISCONNECTED){};
+
+    wl_status_t begin(const char *ssid, const char *passphrase);
+    bool disconnect(bool wifioff = false, bool eraseap = false);
+    wl_status_t status();
+    IPAddress localIP();
+};
+
+extern WiFiClass WiFi;
+
+// Connections are made by the simulated broker, nothing to time out.
+class WiFiClient
+{
+public:
+    int setTimeout(uint32_t seconds)
+    {
+        return 0;
+    }
+};
+
+#endif
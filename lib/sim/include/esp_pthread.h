@@ -0,0 +1,24 @@
+#ifndef esp_pthread_h
+#define esp_pthread_h
+
+#include <cstddef>
+
+#include <esp_err.h>
+
+// Thread configuration is meaningless for simulated tasks so it's only recorded.
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+typedef struct
+{
+    size_t stack_size;
+    size_t prio;
+    bool inherit_cfg;
+    const char *thread_name;
+    int pin_to_core;
+} esp_pthread_cfg_t;
+
+esp_pthread_cfg_t esp_pthread_get_default_config(void);
+esp_err_t esp_pthread_set_cfg(const esp_pthread_cfg_t *cfg);
+esp_err_t esp_pthread_get_cfg(esp_pthread_cfg_t *cfg);
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef sim_ns
+#define sim_ns
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+
+// Deterministic virtual-time scheduler used by the host simulator.
+//
+// Every simulated task runs on its own OS thread but only one of them is
+// allowed to run at a time. Virtual time only advances once every task is
+// blocked, so a sleep never costs real time.
+namespace sim
+{
+    struct Task;
+
+    struct Clock
+    {
+        typedef std::chrono::microseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<Clock> time_point;
+        static const bool is_steady = true;
+
+        static time_point now();
+    };
+
+    // Unix time the simulation starts at, 2026-01-01 00:00 UTC, so the simulated wall clock is set from the start.
+    const uint32_t EPOCH_S = 1767225600;
+
+    void sleep_until(Clock::time_point t);
+
+    template <typename Rep, typename Period>
+    void sleep_for(const std::chrono::duration<Rep, Period> &d)
+    {
+        sleep_until(Clock::now() + std::chrono::duration_cast<Clock::duration>(d));
+    }
+
+    void yield();
+
+    class Mutex
+    {
+        Task *m_owner;
+        std::deque<Task *> m_waiters;
+
+    public:
+        Mutex() : m_owner(nullptr){};
+        Mutex(const Mutex &) = delete;
+        Mutex &operator=(const Mutex &) = delete;
+
+        void lock();
+        bool try_lock();
+        void unlock();
+    };
+
+    class ConditionVariable
+    {
+        std::deque<Task *> m_waiters;
+
+    public:
+        ConditionVariable(){};
+        ConditionVariable(const ConditionVariable &) = delete;
+        ConditionVariable &operator=(const ConditionVariable &) = delete;
+
+        void wait(std::unique_lock<Mutex> &lock);
+        std::cv_status wait_until(std::unique_lock<Mutex> &lock, Clock::time_point t);
+
+        template <typename Predicate>
+        void wait(std::unique_lock<Mutex> &lock, Predicate pred)
+        {
+            while (!pred())
+                wait(lock);
+        }
+
+        void notify_one();
+        void notify_all();
+    };
+
+    // One-shot timer calling `callback(arg)` from a task of its own once it expires.
+    class Timer
+    {
+        void (*m_callback)(void *);
+        void *m_arg;
+        uint64_t m_generation;
+
+    public:
+        Timer(void (*callback)(void *), void *arg) : m_callback(callback), m_arg(arg), m_generation(0){};
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        void setup() {}
+
+        // Replaces the previous expiry if the timer is still running.
+        void start_at(Clock::time_point at);
+        void stop();
+    };
+
+    // Socket on the loopback interface which the simulator sends its datagrams to.
+    // It's bound to whatever port is free rather than the one asked for so several simulations can run side by side.
+    // Every datagram is handled under the tag of the message it was scheduled as until the next call to `receive`.
+    class UdpSocket
+    {
+        int m_socket;
+        // tag of the loop from before the datagram which is being handled
+        uint32_t m_previous_tag;
+        bool m_tagged;
+
+    public:
+        UdpSocket() : m_socket(-1), m_previous_tag(0), m_tagged(false){};
+        UdpSocket(const UdpSocket &) = delete;
+        UdpSocket &operator=(const UdpSocket &) = delete;
+
+        bool begin(uint16_t port);
+        void stop();
+        size_t receive(uint8_t *buffer, size_t size, uint32_t &address, uint16_t &port);
+        bool send(uint32_t address, uint16_t port, const uint8_t *data, size_t size);
+    };
+
+    void spawn_task(std::function<void()> fn);
+
+    template <typename F, typename... Args>
+    void spawn(F &&f, Args &&...args)
+    {
+        spawn_task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    }
+
+    // Runs `root` as the first task and returns once every task is either
+    // finished or blocked forever.
+    void run(std::function<void()> root);
+
+    // Whether any task other than the calling one is ready or sleeping.
+    bool others_pending();
+
+    // Tags are inherited by spawned tasks. Once the last task or context
+    // carrying a tag lets go of it the release handler is called.
+    uint32_t current_tag();
+    void set_current_tag(uint32_t tag);
+    void on_tag_released(void (*handler)(uint32_t tag, Clock::time_point at));
+
+    // Heap allocations made by the whole program so far, the benchmarks report them per operation.
+    size_t allocations();
+
+    // Makes the simulated remote light `led` while any of `buttons` is held
+    // and for a while after it was released.
+    void wire_selection_led(uint8_t led, std::initializer_list<uint8_t> buttons);
+
+    // Holds on to the tag of the task that created it so work handed over to
+    // another task (i.e. through a queue) can be attributed to its origin.
+    class Context
+    {
+        uint32_t m_tag;
+
+    public:
+        Context() : m_tag(0){};
+        Context(const Context &other);
+        Context &operator=(const Context &other);
+        ~Context();
+
+        static Context current();
+
+        // Makes the calling task carry this context's tag.
+        void adopt() const;
+    };
+} // namespace sim
+#endif
@@ -0,0 +1,765 @@
+#include <algorithm>
+#include <map>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <PubSubClient.h>
+#include <WiFi.h>
+#include <esp_partition.h>
+#include <esp_pthread.h>
+#include <nvs.h>
+
+#include <runtime.hpp>
+
+namespace sim
+{
+    Broker g_broker;
+    UdpPeer g_udp_peer;
+    uint16_t g_udp_port = 0;
+    std::vector<Edge> g_edges;
+    bool g_serial_echo = false;
+    std::vector<Outage> g_wifi_outages;
+    esp_pthread_cfg_t g_pthread_cfg = esp_pthread_get_default_config();
+    FlashStats g_flash = {0, 0};
+    Clock::duration g_selection_active_for = std::chrono::milliseconds(3500);
+
+    namespace
+    {
+        std::map<uint8_t, bool> g_pin_levels;
+        std::map<uint8_t, Clock::time_point> g_released_at;
+        std::map<uint8_t, std::vector<uint8_t>> g_selection_leds;
+        bool g_serial_line_start = true;
+
+        const size_t FLASH_SECTOR_SIZE = 4096;
+
+        struct Partition
+        {
+            esp_partition_t info;
+            std::vector<uint8_t> data;
+        };
+
+        // the same data partition as in `partitions.csv`
+        Partition g_eeprom_partition = {
+            {ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x99, 0x290000, 0x2000, "eeprom", false},
+            std::vector<uint8_t>(0x2000, 0xFF),
+        };
+
+        Partition *find_partition(const esp_partition_t *partition)
+        {
+            return partition == &g_eeprom_partition.info ? &g_eeprom_partition : nullptr;
+        }
+    } // namespace
+
+    void wire_selection_led(uint8_t led, std::initializer_list<uint8_t> buttons)
+    {
+        g_selection_leds[led] = buttons;
+    }
+
+    bool topic_matches(const std::string &filter, const std::string &topic)
+    {
+        size_t f = 0, t = 0;
+        while (f < filter.size())
+        {
+            if (filter[f] == '#')
+                return true;
+
+            if (filter[f] == '+')
+            {
+                while (t < topic.size() && topic[t] != '/')
+                    t++;
+                f++;
+                continue;
+            }
+
+            if (t >= topic.size() || filter[f] != topic[t])
+                return false;
+            f++;
+            t++;
+        }
+        return t == topic.size();
+    }
+
+    uint32_t Broker::schedule(Clock::time_point at, const std::string &topic, const std::string &payload)
+    {
+        Message msg{next_message_id(), at, topic, payload, false};
+        auto pos = std::upper_bound(m_inbox.begin(), m_inbox.end(), msg,
+                                    [](const Message &a, const Message &b) { return a.at < b.at; });
+        m_inbox.insert(pos, msg);
+        return msg.id;
+    }
+
+    void Broker::subscribe(const std::string &filter)
+    {
+        m_subscriptions.push_back(filter);
+    }
+
+    bool Broker::publish(const std::string &topic, const std::string &payload, bool retained)
+    {
+        auto now = Clock::now();
+        published.push_back(Message{0, now, topic, payload, retained});
+        for (auto &filter : m_subscriptions)
+        {
+            if (topic_matches(filter, topic))
+            {
+                schedule(now, topic, payload);
+                break;
+            }
+        }
+        return true;
+    }
+
+    bool Broker::take_due(Message &msg)
+    {
+        const auto now = Clock::now();
+        while (!m_inbox.empty() && m_inbox.front().at <= now)
+        {
+            msg = m_inbox.front();
+            m_inbox.pop_front();
+
+            for (auto &filter : m_subscriptions)
+                if (topic_matches(filter, msg.topic))
+                    return true;
+
+            dropped.push_back(msg);
+        }
+        return false;
+    }
+
+    bool Broker::pending() const
+    {
+        return !m_inbox.empty();
+    }
+
+    Clock::time_point Broker::next_at() const
+    {
+        return m_inbox.empty() ? Clock::time_point::max() : m_inbox.front().at;
+    }
+
+    uint32_t next_message_id()
+    {
+        static uint32_t next_id = 1;
+        return next_id++;
+    }
+
+    namespace
+    {
+        sockaddr_in loopback(uint16_t port)
+        {
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            return address;
+        }
+
+        // Non-blocking UDP socket on the loopback interface bound to a free port, -1 if that failed.
+        int open_loopback_socket()
+        {
+            const auto fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0)
+                return -1;
+
+            const auto address = loopback(0);
+            if (bind(fd, (const sockaddr *)&address, sizeof(address)) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+    } // namespace
+
+    uint32_t UdpPeer::schedule(Clock::time_point at, const std::string &payload)
+    {
+        Datagram datagram{next_message_id(), at, payload};
+        auto pos = std::upper_bound(m_outbox.begin(), m_outbox.end(), datagram,
+                                    [](const Datagram &a, const Datagram &b) { return a.at < b.at; });
+        m_outbox.insert(pos, datagram);
+        return datagram.id;
+    }
+
+    void UdpPeer::send_due(uint16_t port, bool reachable)
+    {
+        const auto now = Clock::now();
+        while (!m_outbox.empty() && m_outbox.front().at <= now)
+        {
+            const auto datagram = m_outbox.front();
+            m_outbox.pop_front();
+
+            if (m_socket < 0)
+                m_socket = open_loopback_socket();
+            const auto address = loopback(port);
+            if (port == 0 || !reachable || m_socket < 0 ||
+                sendto(m_socket, datagram.payload.data(), datagram.payload.size(), 0, (const sockaddr *)&address, sizeof(address)) < 0)
+            {
+                lost.push_back(datagram);
+                continue;
+            }
+            m_in_flight.push_back(datagram);
+        }
+    }
+
+    uint32_t UdpPeer::take_in_flight()
+    {
+        if (m_in_flight.empty())
+            return 0;
+        const auto id = m_in_flight.front().id;
+        m_in_flight.pop_front();
+        return id;
+    }
+
+    void UdpPeer::closed()
+    {
+        lost.insert(lost.end(), m_in_flight.begin(), m_in_flight.end());
+        m_in_flight.clear();
+    }
+
+    void UdpPeer::receive()
+    {
+        if (m_socket < 0)
+            return;
+
+        char buffer[1500];
+        ssize_t length;
+        while ((length = recv(m_socket, buffer, sizeof(buffer), 0)) >= 0)
+            acks.push_back(Datagram{0, Clock::now(), std::string(buffer, length)});
+    }
+
+    bool UdpPeer::pending() const
+    {
+        return !m_outbox.empty();
+    }
+
+    Clock::time_point UdpPeer::next_at() const
+    {
+        return m_outbox.empty() ? Clock::time_point::max() : m_outbox.front().at;
+    }
+} // namespace sim
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    sim::g_pin_levels.emplace(pin, false);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    const bool level = val != LOW;
+    auto &current = sim::g_pin_levels[pin];
+    if (current == level)
+        return;
+
+    current = level;
+    sim::g_edges.push_back(sim::Edge{sim::Clock::now(), pin, level});
+    if (!level)
+        sim::g_released_at[pin] = sim::Clock::now();
+}
+
+int digitalRead(uint8_t pin)
+{
+    const auto led = sim::g_selection_leds.find(pin);
+    if (led == sim::g_selection_leds.end())
+        return sim::g_pin_levels[pin] ? HIGH : LOW;
+
+    const auto now = sim::Clock::now();
+    for (auto button : led->second)
+    {
+        if (sim::g_pin_levels[button])
+            return HIGH;
+
+        const auto released = sim::g_released_at.find(button);
+        if (released != sim::g_released_at.end() && now - released->second < sim::g_selection_active_for)
+            return HIGH;
+    }
+    return LOW;
+}
+
+unsigned long millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(sim::Clock::now().time_since_epoch()).count();
+}
+
+unsigned long micros()
+{
+    return sim::Clock::now().time_since_epoch().count();
+}
+
+void delay(uint32_t ms)
+{
+    sim::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void randomSeed(unsigned long seed)
+{
+    srand(seed);
+}
+
+long random(long max)
+{
+    return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+    return min >= max ? min : min + random(max - min);
+}
+
+char *itoa(int value, char *str, int base)
+{
+    if (base == 10)
+        sprintf(str, "%d", value);
+    else if (base == 16)
+        sprintf(str, "%x", value);
+    else
+        sprintf(str, "%o", value);
+    return str;
+}
+
+std::string IPAddress::toString() const
+{
+    char buf[16];
+    sprintf(buf, "%u.%u.%u.%u", m_octets[0], m_octets[1], m_octets[2], m_octets[3]);
+    return buf;
+}
+
+HardwareSerial Serial;
+
+void HardwareSerial::write_str(const char *s)
+{
+    if (!sim::g_serial_echo)
+        return;
+
+    for (; *s; s++)
+    {
+        if (sim::g_serial_line_start)
+            fprintf(stderr, "[%10.3f] ", millis() / 1000.0);
+        fputc(*s, stderr);
+        sim::g_serial_line_start = *s == '\n';
+    }
+}
+
+size_t HardwareSerial::setTxBufferSize(size_t size)
+{
+    m_tx_buffer_size = size;
+    return size;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+}
+
+int HardwareSerial::availableForWrite()
+{
+    return m_tx_buffer_size;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    write_str(std::string((const char *)buffer, size).c_str());
+    return size;
+}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    auto n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    write_str(buf);
+    return n;
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+    write_str(s);
+    return strlen(s);
+}
+
+size_t HardwareSerial::print(char c)
+{
+    return printf("%c", c);
+}
+
+size_t HardwareSerial::print(unsigned char n)
+{
+    return printf("%u", n);
+}
+
+size_t HardwareSerial::print(int n)
+{
+    return printf("%d", n);
+}
+
+size_t HardwareSerial::print(unsigned int n)
+{
+    return printf("%u", n);
+}
+
+size_t HardwareSerial::print(long n)
+{
+    return printf("%ld", n);
+}
+
+size_t HardwareSerial::print(unsigned long n)
+{
+    return printf("%lu", n);
+}
+
+size_t HardwareSerial::print(double n)
+{
+    return printf("%.2f", n);
+}
+
+size_t HardwareSerial::print(const IPAddress &ip)
+{
+    return print(ip.toString().c_str());
+}
+
+size_t HardwareSerial::println()
+{
+    return print("\r\n");
+}
+
+EEPROMClass EEPROM;
+
+bool EEPROMClass::begin(size_t size)
+{
+    m_data.resize(size, 0xFF);
+    return true;
+}
+
+uint8_t EEPROMClass::read(int address)
+{
+    return (size_t)address < m_data.size() ? m_data[address] : 0;
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+    if ((size_t)address < m_data.size())
+        m_data[address] = value;
+}
+
+bool EEPROMClass::commit()
+{
+    m_commits++;
+    return true;
+}
+
+uint8_t *EEPROMClass::getDataPtr()
+{
+    return m_data.data();
+}
+
+size_t EEPROMClass::length()
+{
+    return m_data.size();
+}
+
+WiFiClass WiFi;
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *passphrase)
+{
+    m_status = WL_CONNECTED;
+    return m_status;
+}
+
+bool WiFiClass::disconnect(bool wifioff, bool eraseap)
+{
+    m_status = WL_DISCONNECTED;
+    return true;
+}
+
+wl_status_t WiFiClass::status()
+{
+    const auto now = sim::Clock::now();
+    for (auto &outage : sim::g_wifi_outages)
+        if (m_status == WL_CONNECTED && outage.from <= now && now < outage.until)
+            return WL_CONNECTION_LOST;
+    return m_status;
+}
+
+IPAddress WiFiClass::localIP()
+{
+    return IPAddress(127, 0, 0, 1);
+}
+
+esp_pthread_cfg_t esp_pthread_get_default_config(void)
+{
+    return esp_pthread_cfg_t{3072, 5, false, nullptr, tskNO_AFFINITY};
+}
+
+esp_err_t esp_pthread_set_cfg(const esp_pthread_cfg_t *cfg)
+{
+    sim::g_pthread_cfg = *cfg;
+    return ESP_OK;
+}
+
+esp_err_t esp_pthread_get_cfg(esp_pthread_cfg_t *cfg)
+{
+    *cfg = sim::g_pthread_cfg;
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    const auto &info = sim::g_eeprom_partition.info;
+    if (type != info.type || (subtype != ESP_PARTITION_SUBTYPE_ANY && subtype != info.subtype))
+        return nullptr;
+    if (label && strcmp(label, info.label) != 0)
+        return nullptr;
+    return &info;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    const auto p = sim::find_partition(partition);
+    if (!p)
+        return ESP_ERR_INVALID_ARG;
+    if (src_offset + size > p->data.size())
+        return ESP_ERR_INVALID_SIZE;
+
+    memcpy(dst, p->data.data() + src_offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    const auto p = sim::find_partition(partition);
+    if (!p)
+        return ESP_ERR_INVALID_ARG;
+    if (dst_offset + size > p->data.size())
+        return ESP_ERR_INVALID_SIZE;
+
+    // programming flash can only clear bits
+    const auto bytes = static_cast<const uint8_t *>(src);
+    for (size_t i = 0; i < size; i++)
+        p->data[dst_offset + i] &= bytes[i];
+    sim::g_flash.writes++;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    const auto p = sim::find_partition(partition);
+    if (!p)
+        return ESP_ERR_INVALID_ARG;
+    if (offset % sim::FLASH_SECTOR_SIZE != 0 || size % sim::FLASH_SECTOR_SIZE != 0 || offset + size > p->data.size())
+        return ESP_ERR_INVALID_SIZE;
+
+    std::fill(p->data.begin() + offset, p->data.begin() + offset + size, 0xFF);
+    sim::g_flash.erased_sectors += size / sim::FLASH_SECTOR_SIZE;
+    return ESP_OK;
+}
+
+namespace
+{
+    // blobs by key in every namespace, a handle is the index of its namespace
+    std::vector<std::pair<std::string, std::map<std::string, std::vector<uint8_t>>>> g_nvs;
+} // namespace
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    for (size_t i = 0; i < g_nvs.size(); i++)
+        if (g_nvs[i].first == name)
+        {
+            *out_handle = i;
+            return ESP_OK;
+        }
+    if (open_mode == NVS_READONLY)
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    *out_handle = g_nvs.size();
+    g_nvs.push_back({name, {}});
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    auto &blobs = g_nvs.at(handle).second;
+    const auto blob = blobs.find(key);
+    if (blob == blobs.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (out_value)
+    {
+        if (*length < blob->second.size())
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(out_value, blob->second.data(), blob->second.size());
+    }
+    *length = blob->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    g_nvs.at(handle).second[key].assign((const uint8_t *)value, (const uint8_t *)value + length);
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+PubSubClient &PubSubClient::setServer(const char *domain, uint16_t port)
+{
+    return *this;
+}
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
+{
+    this->callback = callback;
+    return *this;
+}
+
+boolean PubSubClient::connect(const char *id)
+{
+    m_connected = WiFi.status() == WL_CONNECTED;
+    return m_connected;
+}
+
+boolean PubSubClient::connect(const char *id, const char *willTopic, uint8_t willQos, boolean willRetain, const char *willMessage)
+{
+    return connect(id);
+}
+
+void PubSubClient::disconnect()
+{
+    m_connected = false;
+}
+
+boolean PubSubClient::connected()
+{
+    return m_connected;
+}
+
+boolean PubSubClient::subscribe(const char *topic)
+{
+    sim::g_broker.subscribe(topic);
+    return true;
+}
+
+boolean PubSubClient::publish(const char *topic, const char *payload)
+{
+    return publish(topic, payload, false);
+}
+
+boolean PubSubClient::publish(const char *topic, const char *payload, boolean retained)
+{
+    return publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+}
+
+boolean PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength)
+{
+    return publish(topic, payload, plength, false);
+}
+
+boolean PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength, boolean retained)
+{
+    if (WiFi.status() != WL_CONNECTED)
+        m_connected = false;
+    if (!m_connected)
+        return false;
+    return sim::g_broker.publish(topic, std::string((const char *)payload, plength), retained);
+}
+
+boolean PubSubClient::loop()
+{
+    if (WiFi.status() != WL_CONNECTED)
+        m_connected = false;
+    if (!m_connected)
+        return false;
+
+    sim::Message msg;
+    while (sim::g_broker.take_due(msg))
+    {
+        // the real client drops packets which don't fit into its buffer
+        const auto topic_len = msg.topic.size();
+        if (topic_len + 1 + msg.payload.size() + 7 > sizeof(m_buffer))
+        {
+            sim::g_broker.dropped.push_back(msg);
+            continue;
+        }
+
+        auto topic = (char *)m_buffer;
+        memcpy(topic, msg.topic.c_str(), topic_len + 1);
+        auto payload = m_buffer + topic_len + 1;
+        memcpy(payload, msg.payload.data(), msg.payload.size());
+
+        const auto previous_tag = sim::current_tag();
+        sim::set_current_tag(msg.id);
+        if (callback)
+            callback(topic, payload, msg.payload.size());
+        sim::set_current_tag(previous_tag);
+    }
+    return true;
+}
+
+bool sim::UdpSocket::begin(uint16_t port)
+{
+    stop();
+    m_socket = open_loopback_socket();
+    if (m_socket < 0)
+        return false;
+
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    getsockname(m_socket, (sockaddr *)&address, &length);
+    g_udp_port = ntohs(address.sin_port);
+    return true;
+}
+
+void sim::UdpSocket::stop()
+{
+    if (m_socket < 0)
+        return;
+
+    close(m_socket);
+    m_socket = -1;
+    g_udp_port = 0;
+    g_udp_peer.closed();
+}
+
+size_t sim::UdpSocket::receive(uint8_t *buffer, size_t size, uint32_t &address, uint16_t &port)
+{
+    // the previous datagram has been handled
+    if (m_tagged)
+    {
+        set_current_tag(m_previous_tag);
+        m_tagged = false;
+    }
+    if (m_socket < 0 || WiFi.status() != WL_CONNECTED)
+        return 0;
+
+    sockaddr_in from;
+    socklen_t from_length = sizeof(from);
+    const auto length = recvfrom(m_socket, buffer, size, 0, (sockaddr *)&from, &from_length);
+    if (length <= 0)
+        return 0;
+
+    address = from.sin_addr.s_addr;
+    port = ntohs(from.sin_port);
+    m_previous_tag = current_tag();
+    m_tagged = true;
+    set_current_tag(g_udp_peer.take_in_flight());
+    return length;
+}
+
+bool sim::UdpSocket::send(uint32_t address, uint16_t port, const uint8_t *data, size_t size)
+{
+    if (m_socket < 0 || WiFi.status() != WL_CONNECTED)
+        return false;
+
+    sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = address;
+    to.sin_port = htons(port);
+    const auto sent = sendto(m_socket, data, size, 0, (const sockaddr *)&to, sizeof(to));
+    // the answer arrives right away on the loopback interface
+    g_udp_peer.receive();
+    return sent == (ssize_t)size;
+}
@@ -0,0 +1,114 @@
+#ifndef sim_runtime_ns
+#define sim_runtime_ns
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <sim.hpp>
+
+// State shared between the mocked Arduino layer and the simulator driver.
+namespace sim
+{
+    struct Edge
+    {
+        Clock::time_point at;
+        uint8_t pin;
+        bool level;
+    };
+
+    struct Message
+    {
+        uint32_t id;
+        Clock::time_point at;
+        std::string topic;
+        std::string payload;
+        bool retained;
+    };
+
+    class Broker
+    {
+        std::deque<Message> m_inbox;
+        std::vector<std::string> m_subscriptions;
+
+    public:
+        std::vector<Message> published;
+        std::vector<Message> dropped;
+
+        uint32_t schedule(Clock::time_point at, const std::string &topic, const std::string &payload);
+        void subscribe(const std::string &filter);
+        bool publish(const std::string &topic, const std::string &payload, bool retained);
+
+        // Removes the next message that is due for delivery to a subscription.
+        bool take_due(Message &msg);
+        bool pending() const;
+        Clock::time_point next_at() const;
+    };
+
+    struct Datagram
+    {
+        uint32_t id;
+        Clock::time_point at;
+        std::string payload;
+    };
+
+    // Sends datagrams to the firmware's UDP endpoint over a loopback socket, like a wall switch on the local network would.
+    class UdpPeer
+    {
+        std::deque<Datagram> m_outbox;
+        // datagrams which were sent but not read by the firmware yet, in the order they were sent
+        std::deque<Datagram> m_in_flight;
+        int m_socket;
+
+    public:
+        // answers from the firmware
+        std::vector<Datagram> acks;
+        // datagrams which didn't reach the firmware
+        std::vector<Datagram> lost;
+
+        UdpPeer() : m_socket(-1){};
+
+        uint32_t schedule(Clock::time_point at, const std::string &payload);
+        // Sends the datagrams which are due to the firmware listening on `port`,
+        // they're lost if it isn't listening or the access point can't be reached.
+        void send_due(uint16_t port, bool reachable);
+        // Id of the oldest datagram the firmware hasn't read yet, 0 if there is none.
+        uint32_t take_in_flight();
+        // The firmware closed its socket along with the datagrams it didn't read.
+        void closed();
+        // Reads the answers which arrived.
+        void receive();
+        bool pending() const;
+        Clock::time_point next_at() const;
+    };
+
+    struct Outage
+    {
+        Clock::time_point from;
+        Clock::time_point until;
+    };
+
+    struct FlashStats
+    {
+        size_t writes;
+        size_t erased_sectors;
+    };
+
+    extern Broker g_broker;
+    extern UdpPeer g_udp_peer;
+    // port the firmware's UDP socket is bound to, 0 while it isn't listening
+    extern uint16_t g_udp_port;
+    extern std::vector<Edge> g_edges;
+    extern bool g_serial_echo;
+    extern FlashStats g_flash;
+    // periods during which the access point can't be reached
+    extern std::vector<Outage> g_wifi_outages;
+    // how long the simulated remotes keep their selection active after a button was released
+    extern Clock::duration g_selection_active_for;
+
+    bool topic_matches(const std::string &filter, const std::string &topic);
+    // Ids of the messages and datagrams sent to the firmware, which are the tags their latency is tracked with.
+    uint32_t next_message_id();
+} // namespace sim
+#endif
@@ -0,0 +1,386 @@
+#include <sim.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+
+namespace sim
+{
+    typedef std::pair<Clock::time_point, uint64_t> SleepKey;
+
+    struct Task
+    {
+        uint32_t tag;
+        std::condition_variable cv;
+
+        // set while the task is in a timed wait on a condition variable,
+        // it's then both sleeping and in the condition variable's waiters
+        std::deque<Task *> *timed_waiters = nullptr;
+        SleepKey sleep_key;
+        bool timed_out = false;
+    };
+
+    namespace
+    {
+
+        std::mutex g_lock;
+        std::condition_variable g_idle;
+
+        Task *g_current = nullptr;
+        std::deque<Task *> g_ready;
+        std::map<SleepKey, Task *> g_sleepers;
+        uint64_t g_sleep_seq = 0;
+        Clock::time_point g_now;
+
+        std::map<uint32_t, size_t> g_tag_refs;
+        void (*g_tag_released)(uint32_t, Clock::time_point) = nullptr;
+
+        thread_local Task *t_self = nullptr;
+
+        void ref_tag(uint32_t tag)
+        {
+            if (tag != 0)
+                g_tag_refs[tag]++;
+        }
+
+        void unref_tag(uint32_t tag)
+        {
+            if (tag == 0)
+                return;
+
+            auto it = g_tag_refs.find(tag);
+            if (--it->second != 0)
+                return;
+
+            g_tag_refs.erase(it);
+            if (g_tag_released)
+                g_tag_released(tag, g_now);
+        }
+
+        // Hands the baton to the next runnable task and, unless `self` is null,
+        // blocks until it's handed back.
+        void switch_task(std::unique_lock<std::mutex> &lk, Task *self)
+        {
+            Task *next = nullptr;
+            if (!g_ready.empty())
+            {
+                next = g_ready.front();
+                g_ready.pop_front();
+            }
+            else if (!g_sleepers.empty())
+            {
+                auto it = g_sleepers.begin();
+                if (it->first.first > g_now)
+                    g_now = it->first.first;
+                next = it->second;
+                g_sleepers.erase(it);
+
+                if (next->timed_waiters)
+                {
+                    auto &waiters = *next->timed_waiters;
+                    waiters.erase(std::find(waiters.begin(), waiters.end(), next));
+                    next->timed_waiters = nullptr;
+                    next->timed_out = true;
+                }
+            }
+
+            g_current = next;
+            if (next)
+                next->cv.notify_one();
+            else
+                g_idle.notify_all();
+
+            if (self)
+                self->cv.wait(lk, [self] { return g_current == self; });
+        }
+
+        // Makes a task taken off a condition variable's waiters runnable.
+        void wake_waiter(Task *task)
+        {
+            if (task->timed_waiters)
+            {
+                g_sleepers.erase(task->sleep_key);
+                task->timed_waiters = nullptr;
+            }
+            g_ready.push_back(task);
+        }
+
+        void wait_for_baton(std::unique_lock<std::mutex> &lk, Task *self)
+        {
+            self->cv.wait(lk, [self] { return g_current == self; });
+        }
+
+        void start_task(Task *task, std::function<void()> fn)
+        {
+            std::thread([task, fn] {
+                t_self = task;
+                {
+                    std::unique_lock<std::mutex> lk(g_lock);
+                    wait_for_baton(lk, task);
+                }
+
+                fn();
+
+                std::unique_lock<std::mutex> lk(g_lock);
+                unref_tag(task->tag);
+                switch_task(lk, nullptr);
+                lk.unlock();
+                delete task;
+            }).detach();
+        }
+    } // namespace
+
+    Clock::time_point Clock::now()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        return g_now;
+    }
+
+    void sleep_until(Clock::time_point t)
+    {
+        std::unique_lock<std::mutex> lk(g_lock);
+        assert(t_self && g_current == t_self);
+        if (t <= g_now)
+            return;
+
+        g_sleepers.emplace(SleepKey(t, g_sleep_seq++), t_self);
+        switch_task(lk, t_self);
+    }
+
+    void yield()
+    {
+        std::unique_lock<std::mutex> lk(g_lock);
+        g_ready.push_back(t_self);
+        switch_task(lk, t_self);
+    }
+
+    void Mutex::lock()
+    {
+        std::unique_lock<std::mutex> lk(g_lock);
+        if (!m_owner)
+        {
+            m_owner = t_self;
+            return;
+        }
+
+        m_waiters.push_back(t_self);
+        // ownership is handed over by `unlock`
+        switch_task(lk, t_self);
+    }
+
+    bool Mutex::try_lock()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        if (m_owner)
+            return false;
+
+        m_owner = t_self;
+        return true;
+    }
+
+    void Mutex::unlock()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        if (m_waiters.empty())
+        {
+            m_owner = nullptr;
+            return;
+        }
+
+        m_owner = m_waiters.front();
+        m_waiters.pop_front();
+        g_ready.push_back(m_owner);
+    }
+
+    void ConditionVariable::wait(std::unique_lock<Mutex> &lock)
+    {
+        {
+            std::lock_guard<std::mutex> guard(g_lock);
+            m_waiters.push_back(t_self);
+        }
+
+        // no other task can run until we switch, so this is atomic
+        lock.unlock();
+        {
+            std::unique_lock<std::mutex> lk(g_lock);
+            switch_task(lk, t_self);
+        }
+        lock.lock();
+    }
+
+    std::cv_status ConditionVariable::wait_until(std::unique_lock<Mutex> &lock, Clock::time_point t)
+    {
+        {
+            std::lock_guard<std::mutex> guard(g_lock);
+            if (t <= g_now)
+                return std::cv_status::timeout;
+
+            m_waiters.push_back(t_self);
+            t_self->timed_waiters = &m_waiters;
+            t_self->sleep_key = SleepKey(t, g_sleep_seq++);
+            t_self->timed_out = false;
+            g_sleepers.emplace(t_self->sleep_key, t_self);
+        }
+
+        lock.unlock();
+        bool timed_out;
+        {
+            std::unique_lock<std::mutex> lk(g_lock);
+            switch_task(lk, t_self);
+            timed_out = t_self->timed_out;
+        }
+        lock.lock();
+        return timed_out ? std::cv_status::timeout : std::cv_status::no_timeout;
+    }
+
+    void ConditionVariable::notify_one()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        if (m_waiters.empty())
+            return;
+
+        wake_waiter(m_waiters.front());
+        m_waiters.pop_front();
+    }
+
+    void ConditionVariable::notify_all()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        for (auto task : m_waiters)
+            wake_waiter(task);
+        m_waiters.clear();
+    }
+
+    void Timer::start_at(Clock::time_point at)
+    {
+        const auto generation = ++m_generation;
+        spawn_task([this, at, generation] {
+            // the timer doesn't belong to whoever happened to start it
+            set_current_tag(0);
+            sleep_until(at);
+            if (m_generation == generation)
+                m_callback(m_arg);
+        });
+    }
+
+    void Timer::stop()
+    {
+        ++m_generation;
+    }
+
+    void spawn_task(std::function<void()> fn)
+    {
+        auto task = new Task();
+        {
+            std::lock_guard<std::mutex> guard(g_lock);
+            task->tag = t_self ? t_self->tag : 0;
+            ref_tag(task->tag);
+            g_ready.push_back(task);
+        }
+        start_task(task, fn);
+    }
+
+    void run(std::function<void()> root)
+    {
+        spawn_task(root);
+
+        std::unique_lock<std::mutex> lk(g_lock);
+        switch_task(lk, nullptr);
+        g_idle.wait(lk, [] { return g_current == nullptr; });
+    }
+
+    bool others_pending()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        return !g_ready.empty() || !g_sleepers.empty();
+    }
+
+    uint32_t current_tag()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        return t_self ? t_self->tag : 0;
+    }
+
+    void set_current_tag(uint32_t tag)
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        ref_tag(tag);
+        unref_tag(t_self->tag);
+        t_self->tag = tag;
+    }
+
+    void on_tag_released(void (*handler)(uint32_t, Clock::time_point))
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        g_tag_released = handler;
+    }
+
+    Context::Context(const Context &other)
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        m_tag = other.m_tag;
+        ref_tag(m_tag);
+    }
+
+    Context &Context::operator=(const Context &other)
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        ref_tag(other.m_tag);
+        unref_tag(m_tag);
+        m_tag = other.m_tag;
+        return *this;
+    }
+
+    Context::~Context()
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        unref_tag(m_tag);
+    }
+
+    Context Context::current()
+    {
+        Context ctx;
+        {
+            std::lock_guard<std::mutex> guard(g_lock);
+            ctx.m_tag = t_self ? t_self->tag : 0;
+            ref_tag(ctx.m_tag);
+        }
+        return ctx;
+    }
+
+    void Context::adopt() const
+    {
+        set_current_tag(m_tag);
+    }
+
+    namespace
+    {
+        std::atomic<size_t> g_allocations(0);
+    }
+
+    size_t allocations()
+    {
+        return g_allocations;
+    }
+} // namespace sim
+
+// Counts every allocation of the program, the array and nothrow forms end up here too.
+void *operator new(std::size_t size)
+{
+    sim::g_allocations++;
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
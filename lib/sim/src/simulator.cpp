@@ -0,0 +1,540 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+
+#include <runtime.hpp>
+
+// Entry points of the firmware.
+void setup();
+void loop();
+void report_metrics();
+void run_benchmarks();
+bool decode_trace(uint8_t *data, size_t size,
+                  void (*on_command)(uint32_t ms, const char *topic, size_t topic_length, const uint8_t *payload, size_t length),
+                  void (*on_edge)(uint32_t ms, uint8_t pin, bool level),
+                  void (*on_lost)(uint32_t records));
+bool is_selector_pin(uint8_t pin);
+
+namespace sim
+{
+    namespace
+    {
+        // Interval at which the Arduino `loop` is called while there's work to do.
+        const std::chrono::milliseconds LOOP_TICK(10);
+        // When the first record of a replayed trace happens, giving the firmware time to connect.
+        const std::chrono::seconds TRACE_START(5);
+        // First byte of a trace, see `trace.hpp`.
+        const uint8_t TRACE_MAGIC = 0xEC;
+
+        struct Command
+        {
+            uint32_t id;
+            Clock::time_point sent_at;
+            Clock::time_point done_at;
+            bool done;
+            std::string payload;
+        };
+
+        std::map<uint32_t, Command> g_commands;
+
+        // Checked once the simulation is over, see `load_scenario`.
+        struct Expectation
+        {
+            // file and line it came from
+            std::string origin;
+            Clock::time_point at;
+            std::string kind;
+            std::string args;
+        };
+
+        std::vector<Expectation> g_expectations;
+        Clock::time_point g_until = Clock::time_point::max();
+
+        // button edges of the device a replayed trace was recorded on
+        std::vector<Edge> g_recorded_edges;
+        bool g_replaying = false;
+        // records the device couldn't keep up with and chunks which didn't make it into the trace
+        size_t g_trace_lost = 0;
+        size_t g_trace_gaps = 0;
+        uint32_t g_trace_origin_ms;
+
+        void on_command_done(uint32_t tag, Clock::time_point at)
+        {
+            auto it = g_commands.find(tag);
+            if (it == g_commands.end())
+                return;
+
+            it->second.done = true;
+            it->second.done_at = at;
+        }
+
+        void schedule_command(Clock::time_point at, const std::string &topic, const std::string &payload)
+        {
+            const auto id = g_broker.schedule(at, topic, payload);
+            g_commands[id] = Command{id, at, Clock::time_point(), false, payload};
+        }
+
+        void schedule_datagram(Clock::time_point at, const std::string &payload)
+        {
+            const auto id = g_udp_peer.schedule(at, payload);
+            g_commands[id] = Command{id, at, Clock::time_point(), false, payload};
+        }
+
+        // MessagePack documents are shown as JSON.
+        std::string readable(const std::string &payload)
+        {
+            if (payload.empty() || payload[0] == '{')
+                return payload;
+
+            DynamicJsonDocument doc(1024);
+            if (deserializeMsgPack(doc, payload.data(), payload.size()))
+                return payload;
+            char json[1024];
+            serializeJson(doc, json, sizeof(json));
+            return json;
+        }
+
+        // The default scenario is the selection sequence from `test.hpp`.
+        void load_default_scenario()
+        {
+            const Clock::time_point at(std::chrono::seconds(5));
+            for (auto shutter : {14, 8, 11, 9, 12, 10, 15, 13, 3, 0, 7, 4, 2})
+                schedule_command(at, "ewfs/command",
+                                 "{\"op\":\"shutter_stop\",\"shutter\":" + std::to_string(shutter) + "}");
+        }
+
+        // Each line of a scenario file has the form `<milliseconds> <topic> <payload>`.
+        // The topic `$wifi` takes the access point down for the number of milliseconds in the payload.
+        // The topic `$udp` sends the payload as a datagram to the firmware's UDP endpoint instead of publishing it,
+        // `$udp/msgpack` converts it from JSON to MessagePack first.
+        // The topic `$expect` states what the firmware must have done by then, the simulation fails otherwise:
+        //   press <pin> [<tolerance ms>]  the pin went high at that time
+        //   presses <pin> <count>         the pin went high that many times so far
+        //   published <topic> <payload>   the message was published so far
+        //   answer <payload>              the UDP endpoint gave this answer in JSON so far, every line needs an answer of its own
+        //   answer/msgpack <payload>      the same for an answer in MessagePack, written as JSON
+        // Empty lines and lines starting with '#' are ignored.
+        bool load_scenario(const char *path)
+        {
+            std::ifstream file(path);
+            if (!file)
+            {
+                std::cerr << "failed to open scenario: " << path << std::endl;
+                return false;
+            }
+
+            std::string line;
+            size_t lineno = 0;
+            while (std::getline(file, line))
+            {
+                lineno++;
+                if (line.empty() || line[0] == '#')
+                    continue;
+
+                std::istringstream fields(line);
+                long ms;
+                std::string topic, payload;
+                if (!(fields >> ms >> topic) || !std::getline(fields >> std::ws, payload))
+                {
+                    std::cerr << path << ":" << lineno << ": malformed line" << std::endl;
+                    return false;
+                }
+
+                const Clock::time_point at{std::chrono::milliseconds(ms)};
+                if (topic == "$wifi")
+                    g_wifi_outages.push_back(Outage{at, at + std::chrono::milliseconds(atol(payload.c_str()))});
+                else if (topic == "$udp")
+                    schedule_datagram(at, payload);
+                else if (topic == "$expect")
+                {
+                    std::istringstream expectation(payload);
+                    std::string kind, args;
+                    expectation >> kind;
+                    std::getline(expectation >> std::ws, args);
+                    g_expectations.push_back(Expectation{std::string(path) + ":" + std::to_string(lineno), at, kind, args});
+                }
+                else if (topic == "$udp/msgpack")
+                {
+                    DynamicJsonDocument doc(1024);
+                    if (deserializeJson(doc, payload.data(), payload.size()))
+                    {
+                        std::cerr << path << ":" << lineno << ": malformed JSON" << std::endl;
+                        return false;
+                    }
+                    char msgpack[1024];
+                    schedule_datagram(at, std::string(msgpack, serializeMsgPack(doc, msgpack, sizeof(msgpack))));
+                }
+                else
+                    schedule_command(at, topic, payload);
+            }
+            return true;
+        }
+
+        Clock::time_point trace_time(uint32_t ms)
+        {
+            if (!g_replaying)
+            {
+                g_replaying = true;
+                g_trace_origin_ms = ms;
+            }
+            // the device's millis() wrap around after 49 days
+            return Clock::time_point(TRACE_START + std::chrono::milliseconds((uint32_t)(ms - g_trace_origin_ms)));
+        }
+
+        void on_trace_command(uint32_t ms, const char *topic, size_t topic_length, const uint8_t *payload, size_t length)
+        {
+            schedule_command(trace_time(ms), std::string(topic, topic_length), std::string((const char *)payload, length));
+        }
+
+        void on_trace_edge(uint32_t ms, uint8_t pin, bool level)
+        {
+            g_recorded_edges.push_back(Edge{trace_time(ms), pin, level});
+        }
+
+        void on_trace_lost(uint32_t records)
+        {
+            g_trace_lost += records;
+            if (records == 0)
+                g_trace_gaps++;
+        }
+
+        bool is_trace(const char *path)
+        {
+            std::ifstream file(path, std::ios::binary);
+            return file && file.peek() == TRACE_MAGIC;
+        }
+
+        // Replays the commands of a trace recorded on the device at the pace they arrived.
+        bool load_trace(const char *path)
+        {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            if (!decode_trace(data.data(), data.size(), on_trace_command, on_trace_edge, on_trace_lost))
+            {
+                std::cerr << "malformed trace: " << path << std::endl;
+                return false;
+            }
+            if (g_trace_lost > 0 || g_trace_gaps > 0)
+                std::cerr << "trace is incomplete: " << g_trace_lost << " records lost on the device, "
+                          << g_trace_gaps << " gaps between chunks" << std::endl;
+            return true;
+        }
+
+        void run_firmware()
+        {
+            setup();
+            while ((g_broker.pending() || g_udp_peer.pending() || others_pending()) && Clock::now() < g_until)
+            {
+                g_udp_peer.send_due(g_udp_port, WiFi.status() == WL_CONNECTED);
+                loop();
+
+                auto wake_at = Clock::now() + LOOP_TICK;
+                if (!others_pending())
+                {
+                    const auto next_at = std::min(g_broker.next_at(), g_udp_peer.next_at());
+                    // the last message was dropped without leaving anything to do
+                    if (next_at == Clock::time_point::max())
+                        break;
+                    wake_at = std::max(wake_at, next_at);
+                }
+                sleep_until(std::min(wake_at, g_until));
+            }
+        }
+
+        double seconds(Clock::duration d)
+        {
+            return std::chrono::duration<double>(d).count();
+        }
+
+        double seconds(Clock::time_point t)
+        {
+            return seconds(t.time_since_epoch());
+        }
+
+        struct PinStats
+        {
+            size_t presses;
+            Clock::duration high;
+            Clock::time_point rose_at;
+        };
+
+        std::map<uint8_t, PinStats> pin_stats(const std::vector<Edge> &edges)
+        {
+            std::map<uint8_t, PinStats> pins;
+            for (auto &edge : edges)
+            {
+                auto &stats = pins[edge.pin];
+                if (edge.level)
+                {
+                    stats.presses++;
+                    stats.rose_at = edge.at;
+                }
+                else
+                    stats.high += edge.at - stats.rose_at;
+            }
+            return pins;
+        }
+
+        // Airtime is the time any button was held down, i.e. the remote was transmitting.
+        void print_airtime(const char *label, const std::map<uint8_t, PinStats> &pins)
+        {
+            Clock::duration airtime{};
+            size_t selector_presses = 0;
+            for (auto &entry : pins)
+            {
+                airtime += entry.second.high;
+                if (is_selector_pin(entry.first))
+                    selector_presses += entry.second.presses;
+            }
+            printf("%s: %.3f s airtime, %zu selector presses\n", label, seconds(airtime), selector_presses);
+        }
+
+        void report_edges(bool verbose)
+        {
+            if (verbose)
+                for (auto &edge : g_edges)
+                    printf("  %10.3f  pin %2u %s\n", seconds(edge.at), edge.pin, edge.level ? "HIGH" : "LOW");
+
+            const auto pins = pin_stats(g_edges);
+            printf("\nbutton presses per pin:\n");
+            for (auto &entry : pins)
+                printf("  pin %2u: %4zu presses, %9.3f s held\n",
+                       entry.first, entry.second.presses, seconds(entry.second.high));
+
+            printf("\n");
+            print_airtime("simulated", pins);
+            if (g_replaying)
+                print_airtime("recorded ", pin_stats(g_recorded_edges));
+        }
+
+        void report_published()
+        {
+            printf("\npublished:\n");
+            for (auto &msg : g_broker.published)
+                printf("  %10.3f  %s%s  %s\n", seconds(msg.at), msg.topic.c_str(), msg.retained ? " (retained)" : "", msg.payload.c_str());
+
+            if (g_udp_peer.acks.empty())
+                return;
+            printf("\nudp answers:\n");
+            for (auto &ack : g_udp_peer.acks)
+                printf("  %10.3f  %s\n", seconds(ack.at), readable(ack.payload).c_str());
+        }
+
+        void report_commands(bool verbose)
+        {
+            std::vector<double> latencies;
+
+            if (verbose)
+            {
+                printf("\ncommands:\n");
+                printf("  %4s  %10s  %10s  %10s  %s\n", "id", "sent [s]", "done [s]", "latency", "payload");
+            }
+            for (auto &entry : g_commands)
+            {
+                auto &cmd = entry.second;
+                if (!cmd.done)
+                {
+                    if (verbose)
+                        printf("  %4u  %10.3f  %10s  %10s  %s\n", cmd.id, seconds(cmd.sent_at), "-", "-", readable(cmd.payload).c_str());
+                    continue;
+                }
+
+                const auto latency = seconds(cmd.done_at - cmd.sent_at);
+                latencies.push_back(latency);
+                if (verbose)
+                    printf("  %4u  %10.3f  %10.3f  %10.3f  %s\n",
+                           cmd.id, seconds(cmd.sent_at), seconds(cmd.done_at), latency, readable(cmd.payload).c_str());
+            }
+
+            if (latencies.empty())
+                return;
+
+            std::sort(latencies.begin(), latencies.end());
+            // nearest rank, the smallest latency which at least a fraction `p` of the commands didn't exceed
+            auto percentile = [&](double p) { return latencies[(size_t)std::ceil(p * latencies.size()) - 1]; };
+            printf("\nlatency: p50 %.3f s | p90 %.3f s | p99 %.3f s | max %.3f s | %zu/%zu completed\n",
+                   percentile(0.5), percentile(0.9), percentile(0.99), latencies.back(), latencies.size(), g_commands.size());
+        }
+
+        // Returns an explanation if the expectation wasn't met, an empty string if it was.
+        std::string check(const Expectation &expectation, std::vector<bool> &answers_used)
+        {
+            std::istringstream args(expectation.args);
+            if (expectation.kind == "press")
+            {
+                int pin;
+                long tolerance_ms = 0;
+                if (!(args >> pin))
+                    return "malformed expectation";
+                args >> tolerance_ms;
+
+                const auto off = [&](const Edge &edge) {
+                    return edge.at > expectation.at ? edge.at - expectation.at : expectation.at - edge.at;
+                };
+                const Edge *closest = nullptr;
+                for (auto &edge : g_edges)
+                    if (edge.pin == pin && edge.level && (!closest || off(edge) < off(*closest)))
+                        closest = &edge;
+                if (closest && off(*closest) <= std::chrono::milliseconds(tolerance_ms))
+                    return "";
+                if (!closest)
+                    return "pin " + std::to_string(pin) + " was never pressed";
+                char buf[64];
+                snprintf(buf, sizeof(buf), "pin %d was pressed at %.3f s", pin, seconds(closest->at));
+                return buf;
+            }
+            if (expectation.kind == "presses")
+            {
+                int pin;
+                size_t count;
+                if (!(args >> pin >> count))
+                    return "malformed expectation";
+
+                size_t presses = 0;
+                for (auto &edge : g_edges)
+                    if (edge.pin == pin && edge.level && edge.at <= expectation.at)
+                        presses++;
+                return presses == count ? "" : "pin " + std::to_string(pin) + " was pressed " + std::to_string(presses) + " times";
+            }
+            if (expectation.kind == "published")
+            {
+                std::string topic, payload;
+                if (!(args >> topic))
+                    return "malformed expectation";
+                std::getline(args >> std::ws, payload);
+
+                for (auto &msg : g_broker.published)
+                    if (msg.at <= expectation.at && msg.topic == topic && msg.payload == payload)
+                        return "";
+                return "not published";
+            }
+            if (expectation.kind == "answer" || expectation.kind == "answer/msgpack")
+            {
+                const auto msgpack = expectation.kind == "answer/msgpack";
+                for (size_t i = 0; i < g_udp_peer.acks.size(); i++)
+                {
+                    auto &ack = g_udp_peer.acks[i];
+                    const auto json = !ack.payload.empty() && ack.payload[0] == '{';
+                    if (!answers_used[i] && ack.at <= expectation.at && json != msgpack && readable(ack.payload) == expectation.args)
+                    {
+                        answers_used[i] = true;
+                        return "";
+                    }
+                }
+                return "no such answer";
+            }
+            return "unknown expectation: " + expectation.kind;
+        }
+
+        // Returns whether every expectation of the scenario was met.
+        bool report_expectations()
+        {
+            if (g_expectations.empty())
+                return true;
+
+            std::vector<bool> answers_used(g_udp_peer.acks.size());
+            size_t failed = 0;
+            for (auto &expectation : g_expectations)
+            {
+                const auto problem = check(expectation, answers_used);
+                if (problem.empty())
+                    continue;
+                failed++;
+                printf("%s: expected %s %s at %.3f s: %s\n", expectation.origin.c_str(), expectation.kind.c_str(),
+                       expectation.args.c_str(), seconds(expectation.at), problem.c_str());
+            }
+            printf("expectations: %zu/%zu met\n", g_expectations.size() - failed, g_expectations.size());
+            return failed == 0;
+        }
+
+        int usage(const char *argv0)
+        {
+            std::cerr << "usage: " << argv0 << " [-v] [-e] [-c] [-p] [-t <seconds>] [-s <seconds>] [scenario | trace]\n"
+                      << "       " << argv0 << " -b\n"
+                      << "  -v  echo the firmware's serial output to stderr\n"
+                      << "  -e  list every button edge\n"
+                      << "  -c  leave out the list of commands\n"
+                      << "  -p  list every message the firmware published\n"
+                      << "  -t  stop the simulation after the given amount of virtual time\n"
+                      << "  -s  time the remotes keep the selection active (default 3.5)\n"
+                      << "  -b  run the microbenchmarks instead of the firmware\n";
+            return 2;
+        }
+    } // namespace
+} // namespace sim
+
+int main(int argc, char **argv)
+{
+    bool list_edges = false;
+    bool list_commands = true;
+    bool list_published = false;
+    const char *scenario = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-v")
+            sim::g_serial_echo = true;
+        else if (arg == "-e")
+            list_edges = true;
+        else if (arg == "-c")
+            list_commands = false;
+        else if (arg == "-p")
+            list_published = true;
+        else if (arg == "-b")
+        {
+            run_benchmarks();
+            return 0;
+        }
+        else if (arg == "-t" && i + 1 < argc)
+            sim::g_until = sim::Clock::time_point(std::chrono::duration_cast<sim::Clock::duration>(
+                std::chrono::duration<double>(atof(argv[++i]))));
+        else if (arg == "-s" && i + 1 < argc)
+            sim::g_selection_active_for = std::chrono::duration_cast<sim::Clock::duration>(
+                std::chrono::duration<double>(atof(argv[++i])));
+        else if (arg[0] != '-' && !scenario)
+            scenario = argv[i];
+        else
+            return sim::usage(argv[0]);
+    }
+
+    if (!scenario)
+        sim::load_default_scenario();
+    else if (sim::is_trace(scenario) ? !sim::load_trace(scenario) : !sim::load_scenario(scenario))
+        return 1;
+
+    sim::on_tag_released(sim::on_command_done);
+
+    const auto started_at = std::chrono::steady_clock::now();
+    sim::run(sim::run_firmware);
+    const auto real_time = std::chrono::steady_clock::now() - started_at;
+
+    printf("simulated %.3f s in %.3f s\n", sim::seconds(sim::Clock::now()),
+           std::chrono::duration<double>(real_time).count());
+
+    sim::report_edges(list_edges);
+    if (list_published)
+        sim::report_published();
+    sim::report_commands(list_commands);
+    report_metrics();
+    printf("flash: %zu writes, %zu sectors erased\n", sim::g_flash.writes, sim::g_flash.erased_sectors);
+    printf("mqtt: %zu messages published\n", sim::g_broker.published.size());
+    if (!sim::g_udp_peer.acks.empty() || !sim::g_udp_peer.lost.empty())
+        printf("udp: %zu answers, %zu datagrams lost\n", sim::g_udp_peer.acks.size(), sim::g_udp_peer.lost.size());
+
+    const auto met = sim::report_expectations();
+
+    fflush(stdout);
+    // tasks which are blocked forever still hold their threads
+    _Exit(met ? 0 : 1);
+}
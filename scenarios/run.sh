@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs every scenario in this directory through the simulator and fails if any of their expectations isn't met.
+# Build the simulator first: pio run -e native
+program=${1:-.pio/build/native/program}
+status=0
+for scenario in "$(dirname "$0")"/*.txt; do
+    if output=$("$program" -c "$scenario"); then
+        echo "ok      $scenario"
+    else
+        echo "FAILED  $scenario"
+        echo "$output" | grep -E "expected|expectations"
+        status=1
+    fi
+done
+exit $status
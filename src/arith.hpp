@@ -1,3 +1,6 @@
+#ifndef arith_ns
+#define arith_ns
+
 namespace arith
 {
   template <typename T>
@@ -20,4 +23,5 @@ namespace arith
       a += n;
     return mod<T>(a - b, n);
   };
-} // namespace arith
\ No newline at end of file
+} // namespace arith
+#endif
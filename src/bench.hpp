@@ -0,0 +1,322 @@
+#ifndef bench_ns
+#define bench_ns
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <ArduinoJson.h>
+
+#include <arith.hpp>
+#include <controller_table.hpp>
+#include <scheduler.hpp>
+#include <sim.hpp>
+
+// Microbenchmarks of the firmware's hot paths, run on the host with the simulator's `-b`.
+// They're timed by the wall clock, not the virtual one, so only compare numbers from the same machine.
+// Allocations are counted for the whole program, on the board the paths measured here shouldn't make any.
+//
+// This is included at the end of `main.cpp` and uses its functions.
+namespace bench
+{
+    // Long enough for the clock's resolution not to matter.
+    const std::chrono::milliseconds MIN_DURATION(100);
+
+    // Keeps the compiler from optimising away the computation of `value`.
+    template <typename T>
+    inline void keep(const T &value)
+    {
+        asm volatile(""
+                     :
+                     : "g"(&value)
+                     : "memory");
+    }
+
+    struct Cost
+    {
+        double ns;
+        double allocations;
+    };
+
+    // Calls `op` in growing batches until they take `MIN_DURATION` and returns what a single call costs.
+    template <typename F>
+    Cost measure(F op)
+    {
+        for (size_t iterations = 64;; iterations *= 2)
+        {
+            const auto allocations = sim::allocations();
+            const auto started_at = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++)
+                op();
+            const auto elapsed = std::chrono::steady_clock::now() - started_at;
+            if (elapsed >= MIN_DURATION)
+                return Cost{std::chrono::duration<double, std::nano>(elapsed).count() / iterations,
+                            (double)(sim::allocations() - allocations) / iterations};
+        }
+    }
+
+    // Commands as they come in on `ewfs/command`, from the smallest to the largest kind.
+    const char *const COMMANDS[] = {
+        R"({"op":"shutter_stop","shutter":3})",
+        R"({"op":"shutter_down","shutter":12,"mode":"relative","time":12.5,"total_time":30})",
+        R"({"op":"shutter_up","shutters":[0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],"priority":"urgent"})",
+    };
+
+    // `N` controllers with the profile of the first configured one, to build tables of any size.
+    // The sweeps over the number of controllers go from 1 to 32 of them.
+    template <size_t N, typename I = typename controller_table::MakeIndices<N>::type>
+    struct Configs;
+
+    template <size_t N, size_t... I>
+    struct Configs<N, controller_table::Indices<I...>>
+    {
+        static constexpr shutter::ControllerConfig all[N] = {shutter::ControllerConfig(CONTROLLER_CONFIGS[0].profile, 0, 0, 0, 0, (uint8_t)I)...};
+    };
+
+    template <size_t N, size_t... I>
+    constexpr shutter::ControllerConfig Configs<N, controller_table::Indices<I...>>::all[N];
+
+    // Decoding as done by `on_mqtt_message` and encoding as done when publishing,
+    // for the same documents in JSON and MessagePack.
+    void formats()
+    {
+        printf("\nwire formats:\n");
+        printf("  %-8s  %13s  %13s  %9s  %13s\n", "", "size [bytes]", "decode [ns]", "allocs", "encode [ns]");
+        for (auto json : COMMANDS)
+        {
+            StaticMQTTJsonDocument doc;
+            deserializeJson(doc, json);
+
+            char payloads[2][PUBLISH_BUFFER_SIZE];
+            const size_t sizes[2] = {serializeJson(doc, payloads[0], sizeof(payloads[0])),
+                                     serializeMsgPack(doc, payloads[1], sizeof(payloads[1]))};
+            const char *const topics[2] = {"ewfs/command", "ewfs/command" MSGPACK_SUFFIX};
+
+            printf("  %s\n", json);
+            for (size_t format = 0; format < 2; format++)
+            {
+                // both formats are decoded in place, so every run gets a fresh copy
+                byte scratch[PUBLISH_BUFFER_SIZE];
+                const auto decode = measure([&] {
+                    memcpy(scratch, payloads[format], sizes[format]);
+                    StaticMQTTJsonDocument decoded;
+                    command::Command cmd;
+                    keep(decode_command(topics[format], scratch, sizes[format], decoded, cmd));
+                    keep(cmd);
+                });
+
+                char out[PUBLISH_BUFFER_SIZE];
+                const auto encode = measure([&] {
+                    keep(format == 0 ? serializeJson(doc, out, sizeof(out)) : serializeMsgPack(doc, out, sizeof(out)));
+                });
+
+                printf("  %-8s  %13zu  %13.0f  %9.2f  %13.0f\n", format == 0 ? "json" : "msgpack", sizes[format], decode.ns,
+                       decode.allocations, encode.ns);
+            }
+        }
+    }
+
+    // Decoding and splitting up a command for a list of shutters which doubles in length, as `dispatch_command` does,
+    // until the message no longer fits into the document.
+    void message_sizes()
+    {
+        printf("\nmessage sizes:\n");
+        printf("  %8s  %13s  %13s  %9s  %13s  %9s\n", "shutters", "size [bytes]", "decode [ns]", "allocs", "dispatch [ns]", "allocs");
+        for (size_t count = 1;; count *= 2)
+        {
+            char json[PUBLISH_BUFFER_SIZE + 8];
+            auto length = snprintf(json, sizeof(json), R"({"op":"shutter_down","shutters":[)");
+            for (size_t i = 0; i < count && length < (int)sizeof(json); i++)
+                length += snprintf(json + length, sizeof(json) - length, i == 0 ? "%u" : ",%u", (unsigned)(i % TOTAL_SHUTTERS));
+            if (length < (int)sizeof(json))
+                length += snprintf(json + length, sizeof(json) - length, "]}");
+            if (length >= PUBLISH_BUFFER_SIZE)
+            {
+                printf("  %8zu  larger than a message\n", count);
+                return;
+            }
+
+            byte scratch[PUBLISH_BUFFER_SIZE];
+            StaticMQTTJsonDocument doc;
+            command::Command cmd;
+            memcpy(scratch, json, length);
+            if (!decode_command("ewfs/command", scratch, length, doc, cmd) || doc["shutters"].size() != count)
+            {
+                printf("  %8zu  %13d  doesn't fit into the document\n", count, length);
+                return;
+            }
+
+            const auto decode = measure([&] {
+                memcpy(scratch, json, length);
+                StaticMQTTJsonDocument decoded;
+                command::Command decoded_cmd;
+                keep(decode_command("ewfs/command", scratch, length, decoded, decoded_cmd));
+            });
+
+            // the commands are addressed to their controllers but not queued
+            memcpy(scratch, json, length);
+            decode_command("ewfs/command", scratch, length, doc, cmd);
+            const auto dispatch = measure([&] {
+                for_each_shutter(doc, [](uint8_t global_shutter) {
+                    ShutterIndex shutter = global_shutter;
+                    keep(get_controller(&shutter));
+                    keep(shutter);
+                });
+            });
+
+            printf("  %8zu  %13d  %13.0f  %9.2f  %13.0f  %9.2f\n", count, length, decode.ns, decode.allocations, dispatch.ns,
+                   dispatch.allocations);
+        }
+    }
+
+    // Finding the controller of a shutter, as `get_controller` does, in tables of `N` controllers.
+    template <size_t N>
+    void lookup_row()
+    {
+        const auto total = controller_table::total_shutters(Configs<N>::all, N);
+        typedef controller_table::ShutterTable<Configs<N>::all, N, typename controller_table::MakeIndices<controller_table::total_shutters(Configs<N>::all, N)>::type> Table;
+
+        size_t shutter = 0;
+        const auto cost = measure([&] {
+            keep(Table::find(shutter));
+            shutter = shutter + 1 == total ? 0 : shutter + 1;
+        });
+        printf("  %11zu  %8zu  %11.1f  %9.2f\n", N, total, cost.ns, cost.allocations);
+    }
+
+    void lookup()
+    {
+        printf("\ncontroller lookup:\n");
+        printf("  %11s  %8s  %11s  %9s\n", "controllers", "shutters", "find [ns]", "allocs");
+        lookup_row<1>();
+        lookup_row<2>();
+        lookup_row<4>();
+        lookup_row<8>();
+        lookup_row<16>();
+        lookup_row<32>();
+
+        ShutterIndex global_shutter = 0;
+        const auto cost = measure([&] {
+            ShutterIndex shutter = global_shutter;
+            keep(get_controller(&shutter));
+            global_shutter = global_shutter + 1 == TOTAL_SHUTTERS ? 0 : global_shutter + 1;
+        });
+        printf("  %-11s  %8zu  %11.1f  %9.2f\n", "configured", TOTAL_SHUTTERS, cost.ns, cost.allocations);
+    }
+
+    // The ring arithmetic of the selector for every pair of shutters of a controller.
+    void ring_arithmetic()
+    {
+        printf("\nselector arithmetic:\n");
+        printf("  %8s  %13s  %13s\n", "shutters", "add_modn [ns]", "sub_modn [ns]");
+        for (const int total : {8, 32, 128})
+        {
+            int a = 0, b = 0;
+            const auto next = [&] {
+                if (++b == total)
+                {
+                    b = 0;
+                    a = a + 1 == total ? 0 : a + 1;
+                }
+            };
+            const auto add = measure([&] {
+                keep(arith::add_modn(a, b, total));
+                next();
+            });
+            const auto sub = measure([&] {
+                keep(arith::sub_modn(a, b, total));
+                next();
+            });
+            printf("  %8d  %13.1f  %13.1f\n", total, add.ns, sub.ns);
+        }
+    }
+
+    // Picking the next queued command, as `pick_command` does, for queues of every length.
+    void planning()
+    {
+        printf("\nselection planning:\n");
+        printf("  %8s  %6s  %16s  %9s\n", "shutters", "queued", "first_stop [ns]", "allocs");
+        for (const ShutterIndex total : {(ShutterIndex)8, (ShutterIndex)32})
+        {
+            for (size_t count = 1; count <= COMMAND_QUEUE_SIZE; count *= 2)
+            {
+                // spread out so the planner has to consider turning around
+                ShutterIndex targets[COMMAND_QUEUE_SIZE];
+                for (size_t i = 0; i < count; i++)
+                    targets[i] = (i * 5 + 3) % total;
+
+                ShutterIndex selected = 0;
+                const auto cost = measure([&] {
+                    keep(scheduler::first_stop(selected, total, targets, count));
+                    selected = selected + 1 == total ? 0 : selected + 1;
+                });
+                printf("  %8u  %6zu  %16.1f  %9.2f\n", total, count, cost.ns, cost.allocations);
+            }
+        }
+    }
+
+    // The status of `N` controllers as published on `ewfs/state/controllers`.
+    template <size_t N>
+    void controllers_row()
+    {
+        ControllerStatus statuses[N];
+        for (size_t i = 0; i < N; i++)
+            statuses[i] = ControllerStatus{(ShutterIndex)(i % 8), i % 2 == 0, command::Op::Down, (ShutterIndex)(8 * i + 3), (uint8_t)(i % 4)};
+
+        // larger than the publish buffer so the size of documents which wouldn't fit shows
+        char out[N * 96 + 64];
+        size_t size = 0;
+        const auto cost = measure([&] {
+            StaticJsonDocument<CONTROLLER_STATUS_DOCUMENT_SIZE(N)> doc;
+            describe_controllers(doc, 1, statuses, N);
+            size = serialize_document(doc, out, sizeof(out));
+            keep(size);
+        });
+        printf("  %11zu  %13zu%s  %11.0f  %9.2f\n", N, size, size > PUBLISH_BUFFER_SIZE ? "!" : " ", cost.ns, cost.allocations);
+    }
+
+    // Building and serialising the documents published about the state.
+    // The client isn't connected, so everything but the transmission is measured.
+    void serialisation()
+    {
+        printf("\nstate serialisation:\n");
+        printf("  %-22s  %11s  %9s\n", "", "time [ns]", "allocs");
+        const auto shutter_state = measure([] { publish_shutter_state(3, "down"); });
+        printf("  %-22s  %11.0f  %9.2f\n", "publish_shutter_state", shutter_state.ns, shutter_state.allocations);
+
+        PersistentState state;
+        {
+            std::lock_guard<platform::Mutex> guard(g_state_lock);
+            state = g_state;
+        }
+        const auto selections = measure([&] {
+            g_published_selections.invalidate();
+            publish_state(state);
+        });
+        printf("  %-22s  %11.0f  %9.2f\n", "publish_state", selections.ns, selections.allocations);
+
+        const auto snapshot = measure([] { publish_snapshot(); });
+        printf("  %-22s  %11.0f  %9.2f\n", "publish_snapshot", snapshot.ns, snapshot.allocations);
+
+        printf("\n  %11s  %13s   %11s  %9s\n", "controllers", "size [bytes]", "time [ns]", "allocs");
+        controllers_row<1>();
+        controllers_row<2>();
+        controllers_row<4>();
+        controllers_row<8>();
+        controllers_row<16>();
+        controllers_row<32>();
+        printf("  ! doesn't fit into the publish buffer of %d bytes\n", PUBLISH_BUFFER_SIZE);
+    }
+} // namespace bench
+
+// Called by the simulator instead of running the firmware.
+void run_benchmarks()
+{
+    bench::formats();
+    bench::message_sizes();
+    bench::lookup();
+    bench::ring_arithmetic();
+    bench::planning();
+    bench::serialisation();
+}
+#endif
@@ -0,0 +1,161 @@
+#ifndef command_ns
+#define command_ns
+
+#include <cstring>
+#include <type_traits>
+
+#include <queue.hpp>
+#include <shutter.hpp>
+
+namespace command
+{
+    enum class Op : uint8_t
+    {
+        Stop,
+        Up,
+        Down,
+    };
+
+    enum class Mode : uint8_t
+    {
+        // roll until the end stop is reached
+        Default,
+        // roll for the given time
+        Relative,
+        // roll to the end stop and then for the given time back
+        Absolute,
+    };
+
+    // Commands of a higher priority are executed before any waiting command of a lower one.
+    enum class Priority : uint8_t
+    {
+        Normal,
+        // stops and emergencies, they also cut short the repeats of a normal command in progress
+        Urgent,
+    };
+
+    // 32 bits of milliseconds are plenty for any move and keep the command small.
+    typedef std::chrono::duration<int32_t, std::milli> Millis;
+
+    // Commands are copied around by value, i.e. into the command queues.
+    struct Command
+    {
+        Op op;
+        Mode mode;
+        Priority priority;
+        // global index of the shutter
+        ShutterIndex shutter;
+        Millis time;
+        Millis total_time;
+    };
+    static_assert(std::is_trivially_copyable<Command>::value, "commands must be cheap to copy");
+
+    // Names used on the wire, indexed by the value of the enum.
+    const char *const OP_NAMES[] = {"shutter_stop", "shutter_up", "shutter_down"};
+    const char *const MODE_NAMES[] = {"default", "relative", "absolute"};
+    const char *const PRIORITY_NAMES[] = {"normal", "urgent"};
+
+    const char *op_name(Op op)
+    {
+        return OP_NAMES[(size_t)op];
+    }
+
+    const char *mode_name(Mode mode)
+    {
+        return MODE_NAMES[(size_t)mode];
+    }
+
+    // Looks `name` up in `names` and returns its index or `count` if it's unknown.
+    size_t find_name(const char *const *names, size_t count, const char *name)
+    {
+        size_t i = 0;
+        while (i < count && strcmp(names[i], name) != 0)
+            i++;
+        return i;
+    }
+
+    bool parse_op(const char *name, Op &op)
+    {
+        const auto i = find_name(OP_NAMES, sizeof(OP_NAMES) / sizeof(OP_NAMES[0]), name);
+        op = (Op)i;
+        return i < sizeof(OP_NAMES) / sizeof(OP_NAMES[0]);
+    }
+
+    bool parse_mode(const char *name, Mode &mode)
+    {
+        const auto i = find_name(MODE_NAMES, sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]), name);
+        mode = (Mode)i;
+        return i < sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]);
+    }
+
+    bool parse_priority(const char *name, Priority &priority)
+    {
+        const auto i = find_name(PRIORITY_NAMES, sizeof(PRIORITY_NAMES) / sizeof(PRIORITY_NAMES[0]), name);
+        priority = (Priority)i;
+        return i < sizeof(PRIORITY_NAMES) / sizeof(PRIORITY_NAMES[0]);
+    }
+
+    // Direction rolling back the way `op` goes.
+    Op opposite(Op op)
+    {
+        switch (op)
+        {
+        case Op::Up:
+            return Op::Down;
+        case Op::Down:
+            return Op::Up;
+        default:
+            return Op::Stop;
+        }
+    }
+
+    // Folds `next` into the command `queued` which hasn't been executed yet
+    // so only the command producing the final result is transmitted.
+    //
+    // Anything but a relative move determines the final state on its own and supersedes the queued commands.
+    // Relative moves are added onto a queued relative or absolute move instead.
+    queue::Merge coalesce(Command &queued, const Command &next)
+    {
+        if (queued.shutter != next.shutter)
+            return queue::Merge::Skip;
+
+        if (next.mode != Mode::Relative)
+            return queue::Merge::Drop;
+
+        switch (queued.mode)
+        {
+        case Mode::Default:
+            // the relative move ends with a stop while the shutter is still moving
+            return queue::Merge::Append;
+
+        case Mode::Relative:
+        {
+            const auto down_time = (queued.op == Op::Down ? queued.time : -queued.time) +
+                                   (next.op == Op::Down ? next.time : -next.time);
+            if (down_time == chrono_ms::zero())
+                return queue::Merge::Cancel;
+
+            queued.op = down_time > chrono_ms::zero() ? Op::Down : Op::Up;
+            queued.time = down_time > chrono_ms::zero() ? down_time : -down_time;
+            return queue::Merge::Absorb;
+        }
+
+        default:
+        {
+            // time is measured from the end stop the absolute move starts at
+            const auto time = queued.time + (queued.op == next.op ? next.time : -next.time);
+            if (time <= chrono_ms::zero())
+            {
+                queued.op = queued.op == Op::Down ? Op::Up : Op::Down;
+                queued.mode = Mode::Default;
+            }
+            else if (time >= queued.total_time)
+                queued.mode = Mode::Default;
+            else
+                queued.time = time;
+            return queue::Merge::Absorb;
+        }
+        }
+    }
+} // namespace command
+#endif
@@ -11,28 +11,103 @@
 #define MQTT_SERVER_PORT 1883
 // Client id used to communicate with the MQTT server
 #define MQTT_CLIENT_ID "shutter-control"
+// Changes to the selections and positions are collected for this long before they're published.
+#define PUBLISH_BATCH_INTERVAL_MS 250
+// Uncomment to also publish every selection and position in a single retained message.
+// #define MQTT_STATE_TOPIC "ewfs/state"
+// Uncomment to publish documents as MessagePack instead of JSON, on the same topics with "/msgpack" appended.
+// Commands are accepted in both formats either way, MessagePack ones on "ewfs/command/msgpack".
+// #define MQTT_MSGPACK
+// Uncomment to also accept commands over UDP on this port, i.e. from wall switches on the local network, without the round trip through the broker.
+// A datagram holds the same document as "ewfs/command", in JSON or MessagePack, plus a sequence number "seq"
+// and is answered with what became of the command, see `udp.hpp`.
+// #define UDP_COMMAND_PORT 4210
+// Interval at which timing metrics are published on "ewfs/metrics". Comment out to disable.
+#define METRICS_PUBLISH_INTERVAL_MS 60000
+// Uncomment to record the commands and button presses in a binary trace which the simulator can replay.
+// It's either published in chunks which can be concatenated, i.e. `mosquitto_sub -t ewfs/trace -N > week.trace`,
+// or written to the serial port as lines of hex digits starting with "trace: ".
+// #define TRACE_TOPIC "ewfs/trace"
+// #define TRACE_SERIAL
+// Records are streamed once a chunk is full but at least this often.
+#define TRACE_FLUSH_INTERVAL_MS 5000
+
+// Data partition the state is journalled to, see `partitions.csv`. Selections the EEPROM library stored at EEPROM_SELECTION_ADDRESS
+// are taken over on the first start, from NVS with Arduino core 2.x or from this partition where core 1.x kept them.
+#define STATE_PARTITION "eeprom"
+// Changes to the state are collected for this long before they're written to flash.
+#define STATE_FLUSH_INTERVAL_MS 10000
 
 #define EEPROM_SELECTION_ADDRESS 0x00
 #define EEPROM_SELECTION_SIZE 8
+// Estimated shutter positions, two bytes per shutter.
+#define EEPROM_POSITION_SIZE 64
 
 // This is the list of controllers which are attached to the board.
 // A controller is defined by a profile followed by the pins
 // controlling the buttons in the following order:
 //      UP, STOP, DOWN, PREVIOUS, NEXT
+// optionally followed by an input pin wired to the remote's LED which shows that the selection is active.
+// With it the controller doesn't have to wait until it's certain that the selection is off
+// and notices presses of the select buttons which didn't get through.
 //
-// DON'T reuse the same pin for multiple controllers or buttons.
+// DON'T reuse the same pin for multiple controllers or buttons, the build fails if you do.
 //
 // If you need to define a new profile, see the `config_profiles.hpp` file
 //
 // The order of the list is important because the shutters from a controller
 // start with the next index after the previous controller's last shutter.
 // i.e. if the first controller has 8 shutters the first shutter of the second controller has index 8.
-shutter::Controller CONTROLLERS[] = {
+constexpr shutter::ControllerConfig CONTROLLER_CONFIGS[] = {
     {PROFILE_TIMER_8K, 26, 25, 33, 22, 23},
     {PROFILE_HANDHELD_TRANSMITTER, 13, 12, 14, 27, 15},
 };
 
-// Default time in seconds it takes for a shutter to roll down or up completely
+// Every controller has a task executing its commands. This is the core, priority and stack size in bytes it runs with,
+// in the same order as the controllers.
+// Wi-Fi runs on core 0 so the workers are on core 1 by default, above the Arduino loop (priority 1)
+// but below the esp_timer task driving the button presses.
+// How much of every stack was never used is published on "ewfs/metrics/memory", shrink them accordingly.
+constexpr platform::TaskConfig COMMAND_WORKERS[] = {
+    {"ctrl0", 1, 5, 8192},
+    {"ctrl1", 1, 5, 8192},
+};
+// Core, priority and stack size of the task persisting the state. It's kept away from the workers.
+// The state is published by the loop which is the only task talking to the broker.
+constexpr platform::TaskConfig STATE_WRITER_TASK = {"writer", 0, 2, 8192};
+// Uncomment to reserve the stacks of the tasks and the FreeRTOS objects behind the locks at boot
+// so nothing of the firmware allocates from the heap once `setup()` is done.
+// That leaves the Wi-Fi driver and lwIP which take the packets they send and receive from the heap, MQTT's and UDP's alike.
+// "heap_setup_free" next to "heap_min_free" on "ewfs/metrics/memory" shows how much they took at most.
+// Without it the tasks are pthreads and every wait on a condition variable allocates a semaphore.
+// #define STATIC_ALLOCATION
+
+// Maximum amount of commands waiting to be executed per controller.
+// Commands which arrive while the queue is full are rejected.
+#define COMMAND_QUEUE_SIZE 8
+// Maximum amount of absolute or timed moves in progress per controller.
+// The controller can be used for other shutters while they're rolling.
+#define SCHEDULED_COMMANDS_PER_CONTROLLER 8
+// Queued commands are executed in the order which needs the fewest presses of the next / previous buttons.
+// This is how many times a command may be overtaken by newer ones, 0 executes them in the order they arrive.
+#define COMMAND_MAX_BYPASS 4
+// Commands may carry the Unix time they were issued at ("issued_at", whole seconds) and how many seconds
+// they're good for from then on ("ttl"), with the board's clock set over NTP.
+// Commands past their deadline are dropped before they reach a controller.
+#define NTP_SERVER "pool.ntp.org"
+// Seconds a command with "issued_at" but without "ttl" is good for.
+#define COMMAND_DEFAULT_TTL 120
+
+// Default time in seconds it takes for a shutter to roll down or up completely.
+// Absolute moves of a shutter calibrated on "ewfs/model/set" are timed by its model instead,
+// with separate travel times up and down, the motor's start latency and the time the slats take to turn.
 #define DEFAULT_TOTAL_TIME 30.0
 // Default time to roll in relative mode if the duration wasn't specified
 #define DEFAULT_RELATIVE_TIME 10.0
+
+// The position of each shutter is estimated from the time it was rolling so absolute moves
+// can go there directly instead of rolling to the end stop first.
+// Every timed move is assumed to make the estimate worse by this fraction of the full travel...
+#define POSITION_ERROR_PER_MOVE 0.02
+// ...and once it could be off by more than this the shutter rolls to the end stop again.
+#define POSITION_REHOME_THRESHOLD 0.1
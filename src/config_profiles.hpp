@@ -22,6 +22,6 @@
 //
 //   For testing purposes you can set the 3rd argument to 0 and the 4th to something high like 10000ms.
 //   However please note that the 3rd value shouldn't remain 0 as it would drastically slow down the shutter selection.
-shutter::ControllerProfile
+constexpr shutter::ControllerProfile
     PROFILE_TIMER_8K((ShutterIndex)8, chrono_ms(50), chrono_ms(2000), chrono_ms(5000)),
     PROFILE_HANDHELD_TRANSMITTER((ShutterIndex)8, chrono_ms(200), chrono_ms(2000), chrono_ms(5000));
@@ -0,0 +1,54 @@
+#ifndef connection_ns
+#define connection_ns
+
+#include <algorithm>
+#include <chrono>
+
+#include <Arduino.h>
+
+#include <platform.hpp>
+
+namespace connection
+{
+    enum class State : uint8_t
+    {
+        WifiDown,
+        // waiting for the access point to accept us
+        WifiConnecting,
+        MqttDown,
+        Connected,
+    };
+
+    // Delay between connection attempts which doubles with every failure, up to a limit.
+    // A bit of randomness keeps a room full of boards from reconnecting in lockstep after an outage.
+    class Backoff
+    {
+        std::chrono::milliseconds m_initial;
+        std::chrono::milliseconds m_max;
+        std::chrono::milliseconds m_current;
+        platform::Clock::time_point m_next_attempt;
+
+    public:
+        Backoff(std::chrono::milliseconds initial, std::chrono::milliseconds max)
+            : m_initial(initial), m_max(max), m_current(initial), m_next_attempt(){};
+
+        bool due(platform::Clock::time_point now) const
+        {
+            return now >= m_next_attempt;
+        }
+
+        void failed(platform::Clock::time_point now)
+        {
+            const auto jitter = std::chrono::milliseconds(random(m_current.count() / 4 + 1));
+            m_next_attempt = now + m_current + jitter;
+            m_current = std::min(2 * m_current, m_max);
+        }
+
+        void succeeded()
+        {
+            m_current = m_initial;
+            m_next_attempt = platform::Clock::time_point();
+        }
+    };
+} // namespace connection
+#endif
@@ -0,0 +1,112 @@
+#ifndef controller_table_ns
+#define controller_table_ns
+
+#include <cstddef>
+#include <cstdint>
+
+#include <shutter.hpp>
+
+// Everything that can be derived from the controller configuration at compile time.
+// C++11 constexpr functions consist of a single return statement so loops are written as recursion.
+namespace controller_table
+{
+    const uint8_t NO_CONTROLLER = 0xFF;
+
+    // Where a shutter is found, given by its global index.
+    struct ShutterAddress
+    {
+        uint8_t controller;
+        // index relative to the controller
+        ShutterIndex shutter;
+    };
+
+    template <size_t... I>
+    struct Indices
+    {
+    };
+
+    template <size_t N, size_t... I>
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+    {
+    };
+
+    template <size_t... I>
+    struct MakeIndices<0, I...>
+    {
+        typedef Indices<I...> type;
+    };
+
+    constexpr size_t total_shutters(const shutter::ControllerConfig *configs, size_t count)
+    {
+        return count == 0 ? 0 : configs->profile.shutters + total_shutters(configs + 1, count - 1);
+    }
+
+    constexpr ShutterAddress locate(const shutter::ControllerConfig *configs, size_t count, size_t shutter, uint8_t controller = 0)
+    {
+        return count == 0
+                   ? ShutterAddress{NO_CONTROLLER, 0}
+               : shutter < configs->profile.shutters
+                   ? ShutterAddress{controller, (ShutterIndex)shutter}
+                   : locate(configs + 1, count - 1, shutter - configs->profile.shutters, controller + 1);
+    }
+
+    constexpr uint8_t pin_at(const shutter::ControllerConfig *configs, size_t slot)
+    {
+        return configs[slot / shutter::ControllerConfig::PINS].pin(slot % shutter::ControllerConfig::PINS);
+    }
+
+    constexpr bool uses_pin(const shutter::ControllerConfig *configs, size_t count, uint8_t pin, size_t slot = 0)
+    {
+        return slot < count * shutter::ControllerConfig::PINS &&
+               (pin_at(configs, slot) == pin || uses_pin(configs, count, pin, slot + 1));
+    }
+
+    // Whether no pin is used twice, unconnected LEDs aside.
+    constexpr bool pins_unique(const shutter::ControllerConfig *configs, size_t count, size_t slot = 0)
+    {
+        return slot >= count * shutter::ControllerConfig::PINS ||
+               ((pin_at(configs, slot) == shutter::SelectionLed::NO_PIN ||
+                 !uses_pin(configs, count, pin_at(configs, slot), slot + 1)) &&
+                pins_unique(configs, count, slot + 1));
+    }
+
+    constexpr bool profiles_valid(const shutter::ControllerConfig *configs, size_t count)
+    {
+        return count == 0 ||
+               (configs->profile.shutters > 0 &&
+                configs->profile.selection_active_duration_min <= configs->profile.selection_active_duration_max &&
+                profiles_valid(configs + 1, count - 1));
+    }
+
+    // Controllers built from the configurations, in the same order.
+    template <const shutter::ControllerConfig *Configs, typename I>
+    struct Controllers;
+
+    template <const shutter::ControllerConfig *Configs, size_t... I>
+    struct Controllers<Configs, Indices<I...>>
+    {
+        shutter::Controller all[sizeof...(I)];
+
+        Controllers() : all{{Configs[I]}...} {};
+    };
+
+    // Address of every shutter by its global index.
+    template <const shutter::ControllerConfig *Configs, size_t Count, typename I>
+    struct ShutterTable;
+
+    template <const shutter::ControllerConfig *Configs, size_t Count, size_t... I>
+    struct ShutterTable<Configs, Count, Indices<I...>>
+    {
+        static constexpr ShutterAddress addresses[sizeof...(I)] = {locate(Configs, Count, I)...};
+
+        // The controller is `NO_CONTROLLER` if there's no such shutter.
+        static ShutterAddress find(size_t shutter)
+        {
+            return shutter < sizeof...(I) ? addresses[shutter] : ShutterAddress{NO_CONTROLLER, 0};
+        }
+    };
+
+    template <const shutter::ControllerConfig *Configs, size_t Count, size_t... I>
+    constexpr ShutterAddress ShutterTable<Configs, Count, Indices<I...>>::addresses[sizeof...(I)];
+} // namespace controller_table
+#endif
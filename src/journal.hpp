@@ -0,0 +1,254 @@
+#ifndef journal_ns
+#define journal_ns
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include <esp_partition.h>
+
+namespace journal
+{
+    const size_t SECTOR_SIZE = 4096;
+    const uint32_t MAGIC = 0x4a524e4c;
+    const uint32_t ERASED = 0xFFFFFFFF;
+
+    // Pass the result of the previous call as `crc` to continue over data which is read in pieces.
+    uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0)
+    {
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+        {
+            crc ^= data[i];
+            for (auto bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+        return ~crc;
+    }
+
+    // What every record starts with.
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t sequence;
+        // of the value, so records written by a firmware whose value looked different can still be found
+        uint16_t version;
+        uint16_t size;
+    };
+
+    // Where the checksum of a record with a value of `size` bytes is, it's aligned to 4 bytes.
+    constexpr size_t crc_offset(size_t size)
+    {
+        return (sizeof(Header) + size + 3) / 4 * 4;
+    }
+
+    // Append-only log of fixed-size records in a flash partition.
+    //
+    // Every record goes into the next free slot so a sector is only erased once all of its slots are used up,
+    // instead of on every write. Records carry a sequence number and a checksum, the valid one
+    // with the highest sequence number is the current value. A record which was only partly written
+    // when the power went out doesn't pass the checksum and is skipped.
+    //
+    // Records carry the `VERSION` of the layout of `T` and its size. Records of another layout are left alone by `replay`,
+    // `replay_previous` hands over what they hold so it can be carried over to the current layout.
+    template <typename T, uint16_t VERSION>
+    class Journal
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "records are written byte by byte");
+        static_assert(sizeof(T) <= UINT16_MAX, "the size of a value has to fit into the header");
+
+        struct Record
+        {
+            Header header;
+            T value;
+            // covers everything before it
+            uint32_t crc;
+        };
+        static_assert(offsetof(Record, value) == sizeof(Header) && offsetof(Record, crc) == crc_offset(sizeof(T)),
+                      "records of other layouts are found by their header");
+
+        // slots are aligned to the 4 bytes flash is written in
+        static const size_t SLOT_SIZE = sizeof(Record);
+        static const size_t SLOTS_PER_SECTOR = SECTOR_SIZE / SLOT_SIZE;
+
+        const esp_partition_t *m_partition;
+        size_t m_sectors;
+        size_t m_slots;
+        size_t m_next_slot;
+        uint32_t m_sequence;
+
+        static uint32_t _checksum(const Record &record)
+        {
+            return crc32(reinterpret_cast<const uint8_t *>(&record), offsetof(Record, crc));
+        }
+
+        size_t _offset(size_t slot) const
+        {
+            return slot / SLOTS_PER_SECTOR * SECTOR_SIZE + slot % SLOTS_PER_SECTOR * SLOT_SIZE;
+        }
+
+        bool _read(size_t slot, Record &record) const
+        {
+            return esp_partition_read(m_partition, _offset(slot), &record, sizeof(record)) == ESP_OK;
+        }
+
+        static bool _current(const Header &header)
+        {
+            return header.magic == MAGIC && header.version == VERSION && header.size == sizeof(T);
+        }
+
+        // Whether the record of another layout at `offset`, whose header has been read, passes its checksum.
+        bool _check_previous(size_t offset, const Header &header) const
+        {
+            auto crc = crc32(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+            uint8_t bytes[64];
+            for (size_t read = sizeof(header); read < crc_offset(header.size);)
+            {
+                const auto n = std::min(sizeof(bytes), crc_offset(header.size) - read);
+                if (esp_partition_read(m_partition, offset + read, bytes, n) != ESP_OK)
+                    return false;
+                crc = crc32(bytes, n, crc);
+                read += n;
+            }
+
+            uint32_t stored;
+            return esp_partition_read(m_partition, offset + crc_offset(header.size), &stored, sizeof(stored)) == ESP_OK && stored == crc;
+        }
+
+        bool _is_blank(size_t slot) const
+        {
+            uint8_t bytes[SLOT_SIZE];
+            if (esp_partition_read(m_partition, _offset(slot), bytes, SLOT_SIZE) != ESP_OK)
+                return false;
+
+            for (auto b : bytes)
+                if (b != 0xFF)
+                    return false;
+            return true;
+        }
+
+    public:
+        Journal() : m_partition(nullptr), m_sectors(0), m_slots(0), m_next_slot(0), m_sequence(0){};
+
+        // Returns false if there's no data partition with the label.
+        bool setup(const char *label)
+        {
+            m_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+            if (!m_partition)
+                return false;
+
+            m_sectors = m_partition->size / SECTOR_SIZE;
+            m_slots = m_sectors * SLOTS_PER_SECTOR;
+            return m_slots > 0;
+        }
+
+        const esp_partition_t *partition() const
+        {
+            return m_partition;
+        }
+
+        // Whether any slot starts like a record, even one which doesn't pass the checksum.
+        // A partition which is erased or still holds what was there before the journal took it over has none.
+        bool has_records() const
+        {
+            Record record;
+            for (size_t slot = 0; slot < m_slots; slot++)
+                if (_read(slot, record) && record.header.magic == MAGIC)
+                    return true;
+            return false;
+        }
+
+        // Reads the latest valid record. Returns false if there's none.
+        bool replay(T &value)
+        {
+            bool found = false;
+            Record record;
+            for (size_t slot = 0; slot < m_slots; slot++)
+            {
+                if (!_read(slot, record) || !_current(record.header) || record.header.sequence == ERASED)
+                    continue;
+                if (record.crc != _checksum(record) || (found && record.header.sequence <= m_sequence))
+                    continue;
+
+                found = true;
+                value = record.value;
+                m_sequence = record.header.sequence;
+                m_next_slot = (slot + 1) % m_slots;
+            }
+            return found;
+        }
+
+        // Reads the latest valid record written with another layout and copies as much of its value as fits into `data`.
+        // Sectors are only ever filled with records of one layout, the first record of a sector tells which.
+        // Returns false if there's none, otherwise `version` and `size` are the ones of its layout.
+        bool replay_previous(uint16_t &version, uint16_t &size, uint8_t *data, size_t capacity) const
+        {
+            bool found = false;
+            Header latest = {};
+            size_t latest_offset = 0;
+            for (size_t sector = 0; sector < m_sectors; sector++)
+            {
+                Header first;
+                const auto start = sector * SECTOR_SIZE;
+                if (esp_partition_read(m_partition, start, &first, sizeof(first)) != ESP_OK || first.magic != MAGIC || _current(first))
+                    continue;
+
+                const auto slot_size = crc_offset(first.size) + sizeof(uint32_t);
+                for (auto offset = start; offset + slot_size <= start + SECTOR_SIZE; offset += slot_size)
+                {
+                    Header header;
+                    if (esp_partition_read(m_partition, offset, &header, sizeof(header)) != ESP_OK || header.magic != MAGIC)
+                        continue;
+                    if (header.version != first.version || header.size != first.size || header.sequence == ERASED ||
+                        (found && header.sequence <= latest.sequence) || !_check_previous(offset, header))
+                        continue;
+
+                    found = true;
+                    latest = header;
+                    latest_offset = offset;
+                }
+            }
+            if (!found)
+                return false;
+
+            version = latest.version;
+            size = latest.size;
+            return esp_partition_read(m_partition, latest_offset + sizeof(Header), data, std::min(capacity, (size_t)size)) == ESP_OK;
+        }
+
+        bool append(const T &value)
+        {
+            if (!m_partition)
+                return false;
+
+            // a slot holding a torn record or anything else can't be written until its sector is erased
+            for (size_t skipped = 0; skipped < m_slots; skipped++)
+            {
+                const auto slot = m_next_slot;
+                m_next_slot = (m_next_slot + 1) % m_slots;
+
+                if (slot % SLOTS_PER_SECTOR == 0)
+                {
+                    if (esp_partition_erase_range(m_partition, _offset(slot), SECTOR_SIZE) != ESP_OK)
+                        return false;
+                }
+                else if (!_is_blank(slot))
+                    continue;
+
+                Record record;
+                memset(&record, 0, sizeof(record));
+                record.header.magic = MAGIC;
+                record.header.sequence = ++m_sequence;
+                record.header.version = VERSION;
+                record.header.size = sizeof(T);
+                record.value = value;
+                record.crc = _checksum(record);
+                return esp_partition_write(m_partition, _offset(slot), &record, sizeof(record)) == ESP_OK;
+            }
+            return false;
+        }
+    };
+} // namespace journal
+#endif
@@ -1,42 +1,119 @@
 #ifndef led_ns
 #define led_ns
 
+#include <chrono>
+#include <mutex>
+
 #include <Arduino.h>
 
+#include <platform.hpp>
+
 namespace led
 {
     const uint8_t PIN_LED = 2;
 
-    void setup()
+    // `count` flashes of `on_ms` with `off_ms` in between, or flashing until something else is shown if `count` is 0.
+    struct Pattern
     {
-        pinMode(PIN_LED, OUTPUT);
-    }
+        uint16_t on_ms;
+        uint16_t off_ms;
+        uint8_t count;
+    };
 
-    void set_state(bool on)
-    {
-        digitalWrite(PIN_LED, on);
-    }
+    const Pattern OK = {500, 1500, 1};
+    const Pattern ERR = {1500, 500, 1};
+    const Pattern CONNECTING = {125, 125, 0};
 
-    void flash_blocking(uint32_t on_ms, uint32_t off_ms)
+    // Plays patterns on the status LED from a timer so nobody has to wait for them.
+    class Engine
     {
-        set_state(true);
-        delay(on_ms);
-        set_state(false);
-        delay(off_ms);
-    }
-    void flash_blocking(uint32_t delay_ms)
+        platform::Mutex m_lock;
+        platform::Timer m_timer;
+        Pattern m_pattern;
+        // flashes which haven't ended yet
+        uint8_t m_remaining;
+        bool m_on;
+        platform::Clock::time_point m_next_edge;
+
+        static void _on_timer(void *arg)
+        {
+            static_cast<Engine *>(arg)->_advance();
+        }
+
+        void _set(bool on)
+        {
+            m_on = on;
+            digitalWrite(PIN_LED, on);
+        }
+
+        void _advance()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            // the pattern might have been replaced while the timer fired
+            if (platform::Clock::now() < m_next_edge)
+                return;
+
+            if (m_on)
+            {
+                _set(false);
+                if (m_pattern.count != 0 && --m_remaining == 0)
+                {
+                    m_next_edge = platform::Clock::time_point::max();
+                    return;
+                }
+                m_next_edge += std::chrono::milliseconds(m_pattern.off_ms);
+            }
+            else
+            {
+                _set(true);
+                m_next_edge += std::chrono::milliseconds(m_pattern.on_ms);
+            }
+            m_timer.start_at(m_next_edge);
+        }
+
+    public:
+        Engine() : m_timer(_on_timer, this), m_pattern(), m_remaining(0), m_on(false), m_next_edge(platform::Clock::time_point::max()){};
+
+        void setup()
+        {
+            pinMode(PIN_LED, OUTPUT);
+            m_timer.setup();
+        }
+
+        // Replaces whatever is playing, starting with the LED turned on.
+        void play(const Pattern &pattern)
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            m_pattern = pattern;
+            m_remaining = pattern.count;
+            _set(true);
+            m_next_edge = platform::Clock::now() + std::chrono::milliseconds(pattern.on_ms);
+            m_timer.start_at(m_next_edge);
+        }
+
+        void off()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            m_timer.stop();
+            m_next_edge = platform::Clock::time_point::max();
+            _set(false);
+        }
+    };
+
+    Engine g_engine;
+
+    void setup()
     {
-        auto half_ms = delay_ms / 2;
-        flash_blocking(half_ms, half_ms);
+        g_engine.setup();
     }
 
     void flash_ok()
     {
-        flash_blocking(500, 1500);
+        g_engine.play(OK);
     }
     void flash_err()
     {
-        flash_blocking(1500, 500);
+        g_engine.play(ERR);
     }
 } // namespace led
-#endif
\ No newline at end of file
+#endif
@@ -1,242 +1,1590 @@
-#include <thread>
+#include <atomic>
+#include <limits>
 
 #include <esp_err.h>
 #include <esp_pthread.h>
+#include <nvs.h>
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <EEPROM.h>
 #include <WiFi.h>
 #include <PubSubClient.h>
 
+#include <command.hpp>
+#include <connection.hpp>
 #include <led.hpp>
+#include <metrics.hpp>
 #include <config.hpp>
+#include <controller_table.hpp>
+#include <journal.hpp>
+#include <platform.hpp>
+#include <position.hpp>
+#include <publish.hpp>
+#include <queue.hpp>
+#include <scheduler.hpp>
+#include <snapshot.hpp>
+#include <timer.hpp>
+#include <trace.hpp>
+#include <udp.hpp>
 
 #define WIFI_CONNECTION_TIMEOUT_MS 5000
+// Failed connection attempts are retried after this long, doubling up to the maximum.
+#define RECONNECT_BACKOFF_MIN_MS 500
+#define RECONNECT_BACKOFF_MAX_MS 60000
+// Seconds an MQTT connection attempt may wait for the TCP connection and for every read of the broker's answer.
+// PubSubClient connects blocking so this is how long the loop, and the UDP commands it serves, can be held up.
+#define MQTT_CONNECT_TIMEOUT_S 2
+// Senders of UDP commands whose last datagram is remembered to recognise repeats.
+#define UDP_SENDERS 8
+// Shutter events waiting for the loop to publish them, i.e. every queued command expiring at once.
+#define SHUTTER_EVENT_QUEUE_SIZE (CONTROLLER_COUNT * COMMAND_QUEUE_SIZE)
 
 // #define TESTING
 #ifdef TESTING
 #include <test.hpp>
 #endif
 
+#define CONTROLLER_COUNT (sizeof(CONTROLLER_CONFIGS) / sizeof(CONTROLLER_CONFIGS[0]))
+#define TOTAL_SHUTTERS (controller_table::total_shutters(CONTROLLER_CONFIGS, CONTROLLER_COUNT))
+
+#define StaticMQTTJsonDocument StaticJsonDocument<256>
+#define PUBLISH_BUFFER_SIZE MQTT_MAX_PACKET_SIZE
+// Topics carrying MessagePack instead of JSON end in this.
+#define MSGPACK_SUFFIX "/msgpack"
+
+// every tracked position takes up two bytes
+#define TRACKED_SHUTTERS (EEPROM_POSITION_SIZE / 2)
+
+static_assert(CONTROLLER_COUNT < controller_table::NO_CONTROLLER, "too many controllers");
+static_assert(CONTROLLER_COUNT <= EEPROM_SELECTION_SIZE, "EEPROM_SELECTION_SIZE can't hold the selection of every controller");
+static_assert(TOTAL_SHUTTERS <= (size_t)std::numeric_limits<ShutterIndex>::max() + 1, "shutters can't all be addressed by a ShutterIndex");
+static_assert(controller_table::pins_unique(CONTROLLER_CONFIGS, CONTROLLER_COUNT), "a pin is used more than once");
+static_assert(!controller_table::uses_pin(CONTROLLER_CONFIGS, CONTROLLER_COUNT, led::PIN_LED), "a controller uses the pin of the status LED");
+static_assert(controller_table::profiles_valid(CONTROLLER_CONFIGS, CONTROLLER_COUNT), "a profile has no shutters or its selection durations are swapped");
+static_assert(sizeof(COMMAND_WORKERS) / sizeof(COMMAND_WORKERS[0]) == CONTROLLER_COUNT, "every controller needs an entry in COMMAND_WORKERS");
+
+// The Arduino core starts the loop task, this is only used to report on it.
+const platform::TaskConfig LOOP_TASK = {"loop", 1, 1, 8192};
+// the command workers, the state writer and the loop
+#define TASK_COUNT (CONTROLLER_COUNT + 2)
+platform::Tasks<TASK_COUNT, platform::total_stack_size(COMMAND_WORKERS, CONTROLLER_COUNT) + STATE_WRITER_TASK.stack_size> g_tasks;
+
+controller_table::Controllers<CONTROLLER_CONFIGS, controller_table::MakeIndices<CONTROLLER_COUNT>::type> g_controllers;
+auto &CONTROLLERS = g_controllers.all;
+
+typedef controller_table::ShutterTable<CONTROLLER_CONFIGS, CONTROLLER_COUNT, controller_table::MakeIndices<TOTAL_SHUTTERS>::type> ShutterTable;
+
+struct QueuedCommand
+{
+  // index of the shutter relative to its controller
+  ShutterIndex shutter;
+  command::Command command;
+  platform::Clock::time_point queued_at;
+  // the command is dropped if it's still waiting by then
+  platform::Clock::time_point expires_at;
+};
+
+// Rest of a move which is in progress, executed once it's due.
+struct ScheduledCommand
+{
+  // index of the shutter relative to its controller
+  ShutterIndex shutter;
+  command::Command command;
+  // direction the shutter is rolling in until then
+  command::Op rolling;
+};
+
+typedef timer::TimerSet<ScheduledCommand, SCHEDULED_COMMANDS_PER_CONTROLLER> ScheduledCommands;
+
+// Bump whenever `PersistentState` changes. The selections stay at its start so they're carried over from every earlier layout.
+#define STATE_LAYOUT_VERSION 1
+
+// Everything which survives a restart, written to flash as a whole.
+struct PersistentState
+{
+  // selected shutter of every controller
+  uint8_t selections[EEPROM_SELECTION_SIZE];
+  // resting position and uncertainty of every shutter, 0xFF if unknown
+  uint8_t positions[EEPROM_POSITION_SIZE];
+  // how every tracked shutter moves, all 0xFF until it's calibrated
+  position::Model models[TRACKED_SHUTTERS];
+};
+
+// What a controller is doing right now.
+struct ControllerStatus
+{
+  ShutterIndex selected;
+  bool busy;
+  // command being executed and the global index of its shutter while busy
+  command::Op op;
+  ShutterIndex shutter;
+  uint8_t queued;
+};
+
+// Everything a status query answers with, taken as a whole so it's consistent.
+struct StateSnapshot
+{
+  ControllerStatus controllers[CONTROLLER_COUNT];
+  position::Tracker shutters[TRACKED_SHUTTERS];
+};
+
 WiFiClient g_wifi_client;
 PubSubClient g_mqtt_client(g_wifi_client);
+#ifdef UDP_COMMAND_PORT
+platform::UdpSocket g_udp;
+udp::Senders<UDP_SENDERS> g_udp_senders;
+#endif
+
+queue::BoundedQueue<QueuedCommand, COMMAND_QUEUE_SIZE> g_command_queues[CONTROLLER_COUNT];
+// only used by the worker of the controller
+ScheduledCommands g_scheduled_commands[CONTROLLER_COUNT];
+// time every worker held a command instead of waiting for one, most of it is spent sleeping through presses and selections
+std::atomic<uint32_t> g_worker_occupied_ms[CONTROLLER_COUNT];
+// outgoing messages are serialized into this buffer.
+// PubSubClient isn't thread safe, only the loop uses it and the other tasks leave what they want published to it.
+char g_publish_buffer[PUBLISH_BUFFER_SIZE];
+
+// estimated position of every shutter by its global index, only used by the worker of its controller
+position::Tracker g_positions[TRACKED_SHUTTERS];
+// copy of the status and positions which any task can read without waiting for the workers
+snapshot::SeqLock<StateSnapshot> g_snapshot;
+
+journal::Journal<PersistentState, STATE_LAYOUT_VERSION> g_journal;
+// latest state, written to the journal by the state writer
+PersistentState g_state;
+bool g_state_dirty = false;
+// whether the state has changed since it was last published, and when it first did
+bool g_state_unpublished = false;
+platform::Clock::time_point g_state_changed_at;
+platform::Mutex g_state_lock;
+platform::ConditionVariable g_state_changed;
 
-void publish_controller_selections()
+// last values published
+publish::Deltas<uint8_t, CONTROLLER_COUNT> g_published_selections;
+publish::Deltas<PersistentState, 1> g_published_state;
+
+void mark_state_dirty()
 {
-  size_t icontroller = 0;
-  for (auto &c : CONTROLLERS)
+  g_state_dirty = true;
+  if (!g_state_unpublished)
+    g_state_changed_at = time_now();
+  g_state_unpublished = true;
+  g_state_changed.notify_all();
+}
+
+// Reads the selections the EEPROM library of Arduino core 2.x kept in NVS, a blob named like its namespace.
+bool read_nvs_selections(uint8_t *selections)
+{
+  nvs_handle_t handle;
+  if (nvs_open("eeprom", NVS_READONLY, &handle) != ESP_OK)
+    return false;
+
+  uint8_t blob[EEPROM_SELECTION_ADDRESS + EEPROM_SELECTION_SIZE];
+  size_t length = 0;
+  auto found = nvs_get_blob(handle, "eeprom", nullptr, &length) == ESP_OK && length >= sizeof(blob);
+  // the blob can only be read as a whole
+  length = sizeof(blob);
+  found = found && nvs_get_blob(handle, "eeprom", blob, &length) == ESP_OK;
+  nvs_close(handle);
+  if (found)
+    memcpy(selections, blob + EEPROM_SELECTION_ADDRESS, EEPROM_SELECTION_SIZE);
+  return found;
+}
+
+// Reads the latest state from the journal.
+// The selections are never dropped silently, if they can't be trusted the firmware presses the wrong shutters from then on:
+// - a journal written with an earlier layout of the state hands them over,
+// - if the journal was never written they're taken from where the EEPROM library used to store them,
+//   in NVS with Arduino core 2.x or at the start of the partition with core 1.x.
+// A journal whose records are all damaged starts over from nothing instead, its bytes aren't selections.
+void load_state()
+{
+  if (!g_journal.setup(STATE_PARTITION))
+  {
+    Serial.println("no partition to store the state in, it's lost on restart");
+  }
+
+  memset(&g_state, 0xFF, sizeof(g_state));
+  const auto partition = g_journal.partition();
+  if (partition && g_journal.replay(g_state))
+    return;
+
+  uint16_t version, size;
+  if (partition && g_journal.replay_previous(version, size, g_state.selections, sizeof(g_state.selections)))
   {
-    char value_buf[8];
-    itoa(c.get_selected_shutter(), value_buf, 10);
+    Serial.printf("carried the selections over from the state of layout %u\n", version);
+    // anything after the selections is read as unknown
+    if (size < sizeof(g_state.selections))
+      memset(g_state.selections + size, 0xFF, sizeof(g_state.selections) - size);
+  }
+  else if (partition && g_journal.has_records())
+    return;
+  else if (!read_nvs_selections(g_state.selections) && partition)
+    esp_partition_read(partition, EEPROM_SELECTION_ADDRESS, g_state.selections, sizeof(g_state.selections));
+  // written in the current layout right away so it's not taken over again
+  mark_state_dirty();
+}
+
+// Writes the state once it has changed, at most once every `STATE_FLUSH_INTERVAL_MS`
+// so a burst of commands only costs a single write.
+void run_state_writer()
+{
+  while (true)
+  {
+    {
+      std::unique_lock<platform::Mutex> lock(g_state_lock);
+      g_state_changed.wait(lock, [] { return g_state_dirty; });
+    }
+
+    platform::sleep_for(std::chrono::milliseconds(STATE_FLUSH_INTERVAL_MS));
 
-    char topic_buf[32];
-    sprintf(topic_buf, "ewfs/controllers/%u", icontroller++);
-    g_mqtt_client.publish(topic_buf, value_buf, true);
+    PersistentState state;
+    {
+      std::lock_guard<platform::Mutex> guard(g_state_lock);
+      state = g_state;
+      g_state_dirty = false;
+    }
+    metrics::Timed timed(metrics::Phase::Persist);
+    if (!g_journal.append(state))
+      Serial.println("failed to write the state");
   }
 }
 
 void load_controller_selections()
 {
-  size_t address = EEPROM_SELECTION_ADDRESS;
+  size_t icontroller = 0;
   for (auto &c : CONTROLLERS)
   {
-    const auto value = EEPROM.read(address++);
-    if (value != 0xFF)
+    const auto value = g_state.selections[icontroller];
+    if (value < c.total_shutters())
       c.set_shutter_index_no_select(value);
+    g_state.selections[icontroller++] = c.get_selected_shutter();
   }
 }
 
 void update_controller_selections()
 {
-  size_t address = EEPROM_SELECTION_ADDRESS;
+  std::lock_guard<platform::Mutex> guard(g_state_lock);
+  size_t icontroller = 0;
+  bool changed = false;
   for (auto &c : CONTROLLERS)
-    EEPROM.write(address++, c.get_selected_shutter());
-
-  EEPROM.commit();
-  publish_controller_selections();
+  {
+    const auto value = c.get_selected_shutter();
+    changed |= g_state.selections[icontroller] != value;
+    g_state.selections[icontroller++] = value;
+  }
+  if (changed)
+    mark_state_dirty();
 }
 
-void connect_wifi()
+// Positions are stored as the place the shutter comes to rest at so they remain valid
+// even if the board restarts while the shutter is rolling.
+void load_shutter_positions()
 {
-  Serial.println();
-  Serial.print("Connecting to ");
-  Serial.println(WIFI_SSID);
+  size_t offset = 0;
+  for (auto &tracker : g_positions)
+  {
+    const auto position = g_state.positions[offset++];
+    const auto uncertainty = g_state.positions[offset++];
+    if (position != 0xFF && uncertainty != 0xFF)
+      tracker = position::Tracker(position / 254.0f, uncertainty / 254.0f);
+  }
+}
 
-  WiFi.disconnect();
-  delay(1000);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  unsigned long begin_connect_ms = millis();
+void init_snapshot()
+{
+  g_snapshot.update([](StateSnapshot &state) {
+    for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+      state.controllers[icontroller] = ControllerStatus{CONTROLLERS[icontroller].get_selected_shutter(), false, command::Op::Stop, 0, 0};
+    for (size_t shutter = 0; shutter < TRACKED_SHUTTERS; shutter++)
+      state.shutters[shutter] = g_positions[shutter];
+  });
+}
 
-  while (WiFi.status() != WL_CONNECTED)
-  {
-    Serial.print(".");
-    led::flash_blocking(250);
-    if (millis() - begin_connect_ms > WIFI_CONNECTION_TIMEOUT_MS)
+// Publishes what the worker of the controller is doing, `cmd` is null once it's idle.
+void update_controller_status(size_t icontroller, const command::Command *cmd)
+{
+  g_snapshot.update([icontroller, cmd](StateSnapshot &state) {
+    auto &status = state.controllers[icontroller];
+    status.selected = CONTROLLERS[icontroller].get_selected_shutter();
+    status.busy = cmd != nullptr;
+    if (cmd)
     {
-      Serial.println(" TIMEOUT");
-      led::flash_err();
-      return;
+      status.op = cmd->op;
+      status.shutter = cmd->shutter;
     }
+    status.queued = g_command_queues[icontroller].size();
+  });
+}
+
+// Calibrated model of the shutter of the command. Otherwise it's assumed to take the command's total time both ways.
+position::Model shutter_model(const command::Command &cmd)
+{
+  if (cmd.shutter < TRACKED_SHUTTERS)
+  {
+    std::lock_guard<platform::Mutex> guard(g_state_lock);
+    const auto &model = g_state.models[cmd.shutter];
+    if (model.calibrated())
+      return model;
   }
+  return position::Model::linear(cmd.total_time);
+}
 
-  randomSeed(micros());
+void store_shutter_position(ShutterIndex shutter)
+{
+  const auto resting = g_positions[shutter].resting();
+  const uint8_t position = resting.position(time_now()) * 254.0f + 0.5f;
+  const uint8_t uncertainty = std::min(resting.uncertainty(time_now()), 1.0f) * 254.0f + 0.5f;
 
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
-  led::flash_ok();
+  std::lock_guard<platform::Mutex> guard(g_state_lock);
+  auto stored = &g_state.positions[2 * shutter];
+  if (stored[0] == position && stored[1] == uncertainty)
+    return;
+
+  stored[0] = position;
+  stored[1] = uncertainty;
+  mark_state_dirty();
 }
 
 void mqtt_subscribe()
 {
   Serial.println("Subscribing to MQTT topics");
   g_mqtt_client.subscribe("ewfs/command");
+  g_mqtt_client.subscribe("ewfs/command" MSGPACK_SUFFIX);
+  g_mqtt_client.subscribe("ewfs/state/get");
+  g_mqtt_client.subscribe("ewfs/model/set");
+  g_mqtt_client.subscribe("ewfs/model/set" MSGPACK_SUFFIX);
 }
 
-void connect_mqtt()
+template <typename TDocument>
+size_t serialize_document(const TDocument &doc, char *buffer, size_t size)
 {
-  Serial.println("Connecting to MQTT");
-  if (!g_mqtt_client.connect(MQTT_CLIENT_ID, "ewfs/status", 0, true, "offline"))
+#ifdef MQTT_MSGPACK
+  return serializeMsgPack(doc, buffer, size);
+#else
+  return serializeJson(doc, buffer, size);
+#endif
+}
+
+// Publishes the document in the configured format, MessagePack goes to the topic with the suffix appended.
+// Only the loop may publish.
+template <typename TDocument>
+bool publish_document(const char *topic, const TDocument &doc, bool retained = false)
+{
+  const auto n = serialize_document(doc, g_publish_buffer, sizeof(g_publish_buffer));
+#ifdef MQTT_MSGPACK
+  char topic_buf[64];
+  snprintf(topic_buf, sizeof(topic_buf), "%s" MSGPACK_SUFFIX, topic);
+  topic = topic_buf;
+#endif
+  metrics::Timed timed(metrics::Phase::Publish);
+  return g_mqtt_client.publish(topic, (const uint8_t *)g_publish_buffer, n, retained);
+}
+
+#ifdef MQTT_STATE_TOPIC
+// Publishes the selection of every controller and the position of every shutter in percent, null if it's unknown.
+void publish_aggregate_state(const PersistentState &state)
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(CONTROLLER_COUNT) + JSON_ARRAY_SIZE(TRACKED_SHUTTERS)> doc;
+  auto controllers = doc.createNestedArray("controllers");
+  for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+    controllers.add(state.selections[icontroller]);
+
+  auto shutters = doc.createNestedArray("shutters");
+  for (size_t shutter = 0; shutter < std::min(TOTAL_SHUTTERS, (size_t)TRACKED_SHUTTERS); shutter++)
   {
-    led::flash_err();
-    return;
+    const auto position = state.positions[2 * shutter];
+    if (position == 0xFF)
+      shutters.add();
+    else
+      shutters.add((position * 100 + 127) / 254);
   }
 
-  mqtt_subscribe();
-  g_mqtt_client.publish("ewfs/status", "online", true);
-  publish_controller_selections();
-
-  led::flash_ok();
+  if (publish_document(MQTT_STATE_TOPIC, doc, true))
+    g_published_state.sent(0, state);
 }
+#endif
 
-void publish_shutter_state(uint8_t shutter, String state)
+// Publishes the parts of the state which changed since they were last published.
+void publish_state(const PersistentState &state)
 {
-  StaticJsonDocument<256> doc;
-  doc["assumed_state"] = state;
+  for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+  {
+    const auto value = state.selections[icontroller];
+    if (!g_published_selections.changed(icontroller, value))
+      continue;
 
-  char buf[256];
-  auto n = serializeJson(doc, buf);
+    StaticJsonDocument<16> doc;
+    doc.set(value);
+    char topic_buf[24];
+    snprintf(topic_buf, sizeof(topic_buf), "ewfs/controllers/%u", (uint)icontroller);
+    if (publish_document(topic_buf, doc, true))
+      g_published_selections.sent(icontroller, value);
+  }
 
-  char topicBuf[32];
-  sprintf(topicBuf, "ewfs/shutters/%u", shutter);
-  g_mqtt_client.publish(topicBuf, buf, n);
+#ifdef MQTT_STATE_TOPIC
+  if (g_published_state.changed(0, state))
+    publish_aggregate_state(state);
+#endif
 }
 
-shutter::Controller *get_controller(ShutterIndex *shutter)
+// Capacity of the document `describe_controllers` fills in.
+#define CONTROLLER_STATUS_DOCUMENT_SIZE(count) (JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(count) + (count)*JSON_OBJECT_SIZE(5))
+
+// Fills in the document published on `ewfs/state/controllers` for `count` controllers.
+void describe_controllers(JsonDocument &doc, uint32_t version, const ControllerStatus *statuses, size_t count)
 {
-  uint start_index = 0;
-  for (auto &c : CONTROLLERS)
+  doc["version"] = version;
+  auto controllers = doc.createNestedArray("controllers");
+  for (size_t icontroller = 0; icontroller < count; icontroller++)
   {
-    auto end_index = start_index + c.total_shutters();
-    if (*shutter < end_index)
+    const auto &status = statuses[icontroller];
+    auto controller = controllers.createNestedObject();
+    controller["selected"] = status.selected;
+    controller["busy"] = status.busy;
+    if (status.busy)
     {
-      *shutter = *shutter - start_index;
-      return &c;
+      controller["op"] = command::op_name(status.op);
+      controller["shutter"] = status.shutter;
     }
-    start_index = end_index;
+    controller["queued"] = status.queued;
   }
+}
+
+// Answers a request on `ewfs/state/get` from the snapshot, even while every controller is busy.
+// Both messages carry the version of the snapshot they were taken from.
+// Positions are in percent, null if they're unknown, and moving is 1 for down, -1 for up and 0 otherwise.
+void publish_snapshot()
+{
+  StateSnapshot state;
+  const auto version = g_snapshot.read(state);
+  const auto now = time_now();
 
-  throw std::invalid_argument("no such shutter");
+  {
+    StaticJsonDocument<CONTROLLER_STATUS_DOCUMENT_SIZE(CONTROLLER_COUNT)> doc;
+    describe_controllers(doc, version, state.controllers, CONTROLLER_COUNT);
+    publish_document("ewfs/state/controllers", doc);
+  }
+
+  {
+    StaticJsonDocument<JSON_OBJECT_SIZE(3) + 2 * JSON_ARRAY_SIZE(TOTAL_SHUTTERS)> doc;
+    doc["version"] = version;
+    auto positions = doc.createNestedArray("positions");
+    auto moving = doc.createNestedArray("moving");
+    for (size_t shutter = 0; shutter < TOTAL_SHUTTERS; shutter++)
+    {
+      if (shutter >= TRACKED_SHUTTERS || state.shutters[shutter].uncertainty(now) >= 1)
+        positions.add();
+      else
+        positions.add((int)(state.shutters[shutter].position(now) * 100 + 0.5f));
+      moving.add(shutter < TRACKED_SHUTTERS ? state.shutters[shutter].direction(now) : 0);
+    }
+    publish_document("ewfs/state/shutters", doc);
+  }
 }
 
-#define StaticMQTTJsonDocument StaticJsonDocument<256>
+// Publishes changes to the state once they were collected for `PUBLISH_BATCH_INTERVAL_MS`
+// so the commands of a burst don't each publish on their own.
+void publish_changed_state()
+{
+  PersistentState state;
+  {
+    std::lock_guard<platform::Mutex> guard(g_state_lock);
+    if (!g_state_unpublished || time_now() < g_state_changed_at + std::chrono::milliseconds(PUBLISH_BATCH_INTERVAL_MS))
+      return;
+    state = g_state;
+    g_state_unpublished = false;
+  }
+  publish_state(state);
+}
 
-chrono_ms double_seconds_to_chrono_ms(double secs)
+bool connect_mqtt()
 {
-  return chrono_ms((int)(1000 * secs));
+  Serial.println("Connecting to MQTT");
+  if (!g_mqtt_client.connect(MQTT_CLIENT_ID, "ewfs/status", 0, true, "offline"))
+    return false;
+
+  mqtt_subscribe();
+  g_mqtt_client.publish("ewfs/status", "online", true);
+
+  // the broker might not have kept what was published before
+  PersistentState state;
+  {
+    std::lock_guard<platform::Mutex> guard(g_state_lock);
+    state = g_state;
+  }
+  g_published_selections.invalidate();
+  g_published_state.invalidate();
+  publish_state(state);
+  return true;
 }
 
-void handle_command(StaticMQTTJsonDocument doc)
+connection::State g_connection_state = connection::State::WifiDown;
+connection::Backoff g_wifi_backoff(std::chrono::milliseconds(RECONNECT_BACKOFF_MIN_MS), std::chrono::milliseconds(RECONNECT_BACKOFF_MAX_MS));
+connection::Backoff g_mqtt_backoff(std::chrono::milliseconds(RECONNECT_BACKOFF_MIN_MS), std::chrono::milliseconds(RECONNECT_BACKOFF_MAX_MS));
+platform::Clock::time_point g_wifi_deadline;
+
+// Takes the connection one step further every time it's called and returns right away,
+// except for the MQTT connect itself which PubSubClient only does blocking. That's bounded by `MQTT_CONNECT_TIMEOUT_S`
+// for the TCP connection and the broker's answer on top of looking up the broker's name, which lwIP caches once it succeeded.
+// Failed attempts are retried with exponential backoff.
+void poll_connection()
 {
-  const char *op = doc["op"];
-  uint8_t shutter = doc["shutter"];
-  Serial.printf("OP: %s | SHUTTER: %u\n", op, shutter);
+  const auto now = time_now();
+  const auto wifi_connected = WiFi.status() == WL_CONNECTED;
 
-  shutter::Controller *controller;
-  try
+  switch (g_connection_state)
+  {
+  case connection::State::WifiDown:
+    if (!g_wifi_backoff.due(now))
+      return;
+
+    Serial.print("Connecting to ");
+    Serial.println(WIFI_SSID);
+    WiFi.disconnect();
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    g_wifi_deadline = now + std::chrono::milliseconds(WIFI_CONNECTION_TIMEOUT_MS);
+    led::g_engine.play(led::CONNECTING);
+    g_connection_state = connection::State::WifiConnecting;
+    return;
+
+  case connection::State::WifiConnecting:
+    if (wifi_connected)
+    {
+      randomSeed(micros());
+      Serial.print("WiFi connected, IP address: ");
+      Serial.println(WiFi.localIP());
+      platform::sync_wall_clock(NTP_SERVER);
+#ifdef UDP_COMMAND_PORT
+      g_udp.begin(UDP_COMMAND_PORT);
+#endif
+      g_wifi_backoff.succeeded();
+      g_connection_state = connection::State::MqttDown;
+    }
+    else if (now >= g_wifi_deadline)
+    {
+      Serial.println("WiFi connection timed out");
+      g_wifi_backoff.failed(now);
+      led::flash_err();
+      g_connection_state = connection::State::WifiDown;
+    }
+    return;
+
+  case connection::State::MqttDown:
+    if (!wifi_connected)
+    {
+      g_connection_state = connection::State::WifiDown;
+      return;
+    }
+    if (!g_mqtt_backoff.due(now))
+      return;
+
+    if (!connect_mqtt())
+    {
+      g_mqtt_backoff.failed(now);
+      led::flash_err();
+      return;
+    }
+    g_mqtt_backoff.succeeded();
+    led::flash_ok();
+    g_connection_state = connection::State::Connected;
+    return;
+
+  case connection::State::Connected:
+    if (!wifi_connected)
+      g_connection_state = connection::State::WifiDown;
+    else if (!g_mqtt_client.loop())
+      g_connection_state = connection::State::MqttDown;
+    return;
+  }
+}
+
+#ifdef METRICS_PUBLISH_INTERVAL_MS
+// recordings per phase when they were last published
+publish::Deltas<uint32_t, metrics::PHASE_COUNT> g_published_phase_counts;
+platform::Clock::time_point g_metrics_due;
+// free heap once `setup()` was done, anything below it was taken by the network stack since
+size_t g_heap_setup_free;
+
+// Publishes the counters on `ewfs/metrics` and the histogram of every phase with new recordings on `ewfs/metrics/<phase>`.
+// Bucket i of a histogram counts the durations below 2^i ms.
+void publish_metrics()
+{
+  const auto &registry = metrics::g_registry;
   {
-    controller = get_controller(&shutter);
+    StaticJsonDocument<JSON_OBJECT_SIZE(1 + metrics::COUNTER_COUNT)> doc;
+    doc["uptime_s"] = millis() / 1000;
+    for (size_t i = 0; i < metrics::COUNTER_COUNT; i++)
+      doc[metrics::COUNTER_NAMES[i]] = registry.counter((metrics::Counter)i);
+    publish_document("ewfs/metrics", doc);
   }
-  catch (const std::invalid_argument &e)
+
+  {
+    // share of the uptime every worker held a command, which is how long its controller was taken rather than CPU time
+    StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(CONTROLLER_COUNT)> doc;
+    auto occupied = doc.createNestedArray("occupied_pct");
+    const auto uptime_ms = millis();
+    for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+      occupied.add(uptime_ms > 0 ? 100.0 * g_worker_occupied_ms[icontroller] / uptime_ms : 0.0);
+    publish_document("ewfs/metrics/workers", doc);
+  }
+
   {
-    Serial.print("invalid shutter: ");
-    Serial.println(shutter);
+    // bytes of every task's stack which were never used, and the least the heap has had left
+    StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(TASK_COUNT)> doc;
+    doc["heap_free"] = platform::free_heap();
+    doc["heap_min_free"] = platform::min_free_heap();
+    doc["heap_setup_free"] = g_heap_setup_free;
+    auto stacks = doc.createNestedObject("stack_free");
+    for (size_t i = 0; i < g_tasks.count(); i++)
+      stacks[g_tasks.config(i).name] = g_tasks.stack_free(i);
+    publish_document("ewfs/metrics/memory", doc);
+  }
+
+  for (size_t i = 0; i < metrics::PHASE_COUNT; i++)
+  {
+    const auto &histogram = registry.phase((metrics::Phase)i);
+    const auto count = histogram.count();
+    if (!g_published_phase_counts.changed(i, count))
+      continue;
+    g_published_phase_counts.sent(i, count);
+
+    StaticJsonDocument<JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(metrics::BUCKETS)> doc;
+    doc["count"] = count;
+    doc["total_ms"] = histogram.total_ms();
+    doc["max_ms"] = histogram.max_ms();
+    doc["p50_ms"] = histogram.percentile_ms(0.5f);
+    doc["p90_ms"] = histogram.percentile_ms(0.9f);
+    doc["p99_ms"] = histogram.percentile_ms(0.99f);
+    auto buckets = doc.createNestedArray("buckets");
+    for (size_t bucket = 0; bucket < metrics::BUCKETS; bucket++)
+      buckets.add(histogram.bucket_count(bucket));
+
+    char topic_buf[40];
+    snprintf(topic_buf, sizeof(topic_buf), "ewfs/metrics/%s", metrics::PHASE_NAMES[i]);
+    publish_document(topic_buf, doc);
+  }
+}
+#endif
+
+#if defined(TRACE_TOPIC) || defined(TRACE_SERIAL)
+platform::Clock::time_point g_trace_due;
+
+#ifdef TRACE_SERIAL
+// "trace: ", two hex digits per byte of a chunk and the line break
+const size_t TRACE_LINE_SIZE = 7 + 2 * trace::MAX_CHUNK_SIZE + 2;
+// chunk which waits for room in the serial port's buffer so the loop is never held up by the port
+uint8_t g_trace_chunk[trace::MAX_CHUNK_SIZE];
+size_t g_trace_chunk_size;
+
+// Writes the waiting chunk as a line if the serial port's buffer takes all of it, returns false if it has to wait.
+bool write_trace_line()
+{
+  if (g_trace_chunk_size == 0)
+    return true;
+
+  char line[TRACE_LINE_SIZE + 1];
+  auto length = sprintf(line, "trace: ");
+  for (size_t i = 0; i < g_trace_chunk_size; i++)
+    length += sprintf(&line[length], "%02x", g_trace_chunk[i]);
+  length += sprintf(&line[length], "\r\n");
+  if (Serial.availableForWrite() < length)
+    return false;
+
+  Serial.write((const uint8_t *)line, length);
+  g_trace_chunk_size = 0;
+  return true;
+}
+#endif
+
+// Streams the recorded trace once a chunk is full or the flush interval has passed.
+// On the serial port every chunk is a line of hex digits starting with "trace: ".
+void stream_trace()
+{
+#ifdef TRACE_SERIAL
+  if (!write_trace_line())
     return;
+#endif
+  const auto pending = trace::g_recorder.pending();
+  if (pending == 0 || (pending < TRACE_CHUNK_SIZE && time_now() < g_trace_due))
+    return;
+#ifndef TRACE_SERIAL
+  // keep the records until they can be published
+  if (g_connection_state != connection::State::Connected)
+    return;
+#endif
+  g_trace_due = time_now() + std::chrono::milliseconds(TRACE_FLUSH_INTERVAL_MS);
+
+  uint8_t chunk[trace::MAX_CHUNK_SIZE];
+  size_t size;
+  while ((size = trace::g_recorder.take_chunk(chunk)) != 0)
+  {
+#ifdef TRACE_TOPIC
+    if (g_connection_state == connection::State::Connected)
+      g_mqtt_client.publish(TRACE_TOPIC, chunk, size);
+#endif
+#ifdef TRACE_SERIAL
+    // the rest is taken once the port caught up
+    memcpy(g_trace_chunk, chunk, size);
+    g_trace_chunk_size = size;
+    if (!write_trace_line())
+      return;
+#endif
   }
+}
+#endif
 
-  if (strcmp(op, "shutter_stop") == 0)
+#ifdef SIMULATOR
+// Called by the simulator to replay a trace, see `trace::read`.
+bool decode_trace(uint8_t *data, size_t size,
+                  void (*on_command)(uint32_t ms, const char *topic, size_t topic_length, const uint8_t *payload, size_t length),
+                  void (*on_edge)(uint32_t ms, uint8_t pin, bool level),
+                  void (*on_lost)(uint32_t records))
+{
+  struct Handler
   {
-    controller->roll_stop(shutter);
-    update_controller_selections();
+    decltype(on_command) command;
+    decltype(on_edge) edge;
+    decltype(on_lost) lost;
+  } handler = {on_command, on_edge, on_lost};
+  return trace::read(data, size, handler);
+}
+
+// Whether the pin is wired to the previous or next button of a remote.
+bool is_selector_pin(uint8_t pin)
+{
+  for (auto &config : CONTROLLER_CONFIGS)
+    if (config.previous == pin || config.next == pin)
+      return true;
+  return false;
+}
+
+// Called by the simulator once it's done.
+void report_metrics()
+{
+  const auto &registry = metrics::g_registry;
+  printf("\nphases:\n");
+  printf("  %-16s  %6s  %9s  %9s  %9s  %9s  %11s\n", "phase", "count", "p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]", "total [ms]");
+  for (size_t i = 0; i < metrics::PHASE_COUNT; i++)
+  {
+    const auto &histogram = registry.phase((metrics::Phase)i);
+    printf("  %-16s  %6u  %9u  %9u  %9u  %9u  %11u\n", metrics::PHASE_NAMES[i], histogram.count(),
+           histogram.percentile_ms(0.5f), histogram.percentile_ms(0.9f), histogram.percentile_ms(0.99f),
+           histogram.max_ms(), histogram.total_ms());
+  }
+
+  printf("\ncounters:\n");
+  for (size_t i = 0; i < metrics::COUNTER_COUNT; i++)
+    printf("  %-20s  %6u\n", metrics::COUNTER_NAMES[i], registry.counter((metrics::Counter)i));
+
+  printf("\nworkers:\n");
+  for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+    printf("  %-6s  core %2d  prio %2u  %10.3f s occupied (%.1f %%)\n", COMMAND_WORKERS[icontroller].name,
+           COMMAND_WORKERS[icontroller].core, COMMAND_WORKERS[icontroller].priority, g_worker_occupied_ms[icontroller] / 1000.0,
+           millis() > 0 ? 100.0 * g_worker_occupied_ms[icontroller] / millis() : 0.0);
+}
+#endif
+
+void publish_shutter_state(uint8_t shutter, const char *state)
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(1)> doc;
+  doc["assumed_state"] = state;
+
+  char topic_buf[32];
+  sprintf(topic_buf, "ewfs/shutters/%u", shutter);
+  publish_document(topic_buf, doc);
+}
+
+// What happened to a command, kept until the loop publishes it on "ewfs/shutters/<shutter>/events".
+struct ShutterEvent
+{
+  const char *event;
+  command::Command cmd;
+};
+
+ShutterEvent g_shutter_events[SHUTTER_EVENT_QUEUE_SIZE];
+size_t g_shutter_event_count = 0;
+platform::Mutex g_shutter_events_lock;
+
+// Leaves the event for the loop to publish, from any task.
+void publish_shutter_event(const char *event, const command::Command &cmd)
+{
+  std::lock_guard<platform::Mutex> guard(g_shutter_events_lock);
+  if (g_shutter_event_count == SHUTTER_EVENT_QUEUE_SIZE)
+  {
+    Serial.print("too many shutter events, dropping one for shutter: ");
+    Serial.println(cmd.shutter);
     return;
   }
+  g_shutter_events[g_shutter_event_count++] = ShutterEvent{event, cmd};
+}
+
+// Publishes the shutter events left by every task since the last call.
+void publish_shutter_events()
+{
+  ShutterEvent events[SHUTTER_EVENT_QUEUE_SIZE];
+  size_t count;
+  {
+    std::lock_guard<platform::Mutex> guard(g_shutter_events_lock);
+    count = g_shutter_event_count;
+    std::copy(g_shutter_events, g_shutter_events + count, events);
+    g_shutter_event_count = 0;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const auto &cmd = events[i].cmd;
+    StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+    doc["event"] = events[i].event;
+    doc["op"] = command::op_name(cmd.op);
+    if (cmd.op != command::Op::Stop)
+      doc["mode"] = command::mode_name(cmd.mode);
+    if (cmd.mode != command::Mode::Default)
+      doc["time"] = cmd.time.count() / 1000.0;
+
+    char topic_buf[40];
+    sprintf(topic_buf, "ewfs/shutters/%u/events", cmd.shutter);
+    publish_document(topic_buf, doc);
+  }
+}
+
+// Turns the global index of the shutter into the one relative to its controller.
+// Returns null if there's no such shutter.
+shutter::Controller *get_controller(ShutterIndex *shutter)
+{
+  const auto address = ShutterTable::find(*shutter);
+  if (address.controller == controller_table::NO_CONTROLLER)
+    return nullptr;
 
-  bool roll_up;
-  if (strcmp(op, "shutter_up") == 0)
-    roll_up = true;
-  else if (strcmp(op, "shutter_down") == 0)
-    roll_up = false;
+  *shutter = address.shutter;
+  return &CONTROLLERS[address.controller];
+}
+
+command::Millis double_seconds_to_millis(double secs)
+{
+  return command::Millis((int32_t)(1000 * secs));
+}
+
+// Whether `value` is the index of a shutter, anything else such as -1, 300 or "3" would silently address another one.
+bool is_shutter_index(JsonVariantConst value)
+{
+  return value.is<uint8_t>() && value.as<uint8_t>() < TOTAL_SHUTTERS;
+}
+
+// Checks the shutters a command addresses before anything is done for them, see `for_each_shutter`.
+bool check_shutters(const StaticMQTTJsonDocument &doc)
+{
+  JsonVariantConst shutters = doc["shutters"];
+  bool valid;
+  if (strcmp(shutters | "", "all") == 0)
+    valid = true;
+  else if (shutters.is<JsonArrayConst>())
+  {
+    valid = true;
+    for (JsonVariantConst shutter : shutters.as<JsonArrayConst>())
+      valid = valid && is_shutter_index(shutter);
+  }
+  else if (!shutters.isNull())
+    valid = false;
+  else if (!doc["from"].isNull())
+    valid = is_shutter_index(doc["from"]) && is_shutter_index(doc["to"]) && doc["from"].as<uint8_t>() <= doc["to"].as<uint8_t>();
   else
+    valid = is_shutter_index(doc["shutter"]);
+
+  if (!valid)
+  {
+    Serial.print("received invalid shutters, they go from 0 to ");
+    Serial.println((unsigned int)(TOTAL_SHUTTERS - 1));
+  }
+  return valid;
+}
+
+bool parse_command(const StaticMQTTJsonDocument &doc, command::Command &cmd)
+{
+  const char *op = doc["op"] | "";
+  if (!command::parse_op(op, cmd.op))
   {
     Serial.print("received unknown operation: ");
     Serial.println(op);
+    return false;
+  }
+  if (!check_shutters(doc))
+    return false;
+
+  if (cmd.op == command::Op::Stop || !command::parse_mode(doc["mode"] | "default", cmd.mode))
+    cmd.mode = command::Mode::Default;
+
+  if (cmd.mode == command::Mode::Absolute)
+    cmd.time = double_seconds_to_millis(doc["time"]);
+  else
+    cmd.time = double_seconds_to_millis(doc["time"] | DEFAULT_RELATIVE_TIME);
+  cmd.total_time = double_seconds_to_millis(doc["total_time"] | DEFAULT_TOTAL_TIME);
+
+  // stopping is what somebody wants right away
+  const auto urgent = cmd.op == command::Op::Stop;
+  if (!command::parse_priority(doc["priority"] | (urgent ? "urgent" : "normal"), cmd.priority))
+    cmd.priority = urgent ? command::Priority::Urgent : command::Priority::Normal;
+  return true;
+}
+
+bool has_suffix(const char *s, const char *suffix)
+{
+  const auto length = strlen(s);
+  const auto suffix_length = strlen(suffix);
+  return length >= suffix_length && strcmp(s + length - suffix_length, suffix) == 0;
+}
+
+// Deserializes the message, as MessagePack if the topic has the suffix for it.
+// Strings aren't copied, the document keeps referring to the payload which is modified.
+bool deserialize_message(const char *topic, byte *payload, unsigned int length, StaticMQTTJsonDocument &doc)
+{
+  const auto err = has_suffix(topic, MSGPACK_SUFFIX) ? deserializeMsgPack(doc, payload, length)
+                                                     : deserializeJson(doc, payload, length);
+  if (err)
+  {
+    Serial.print("failed to deserialize message: ");
+    Serial.println(err.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Deserializes the message and decodes the command in it.
+// The document is deserialized in place from the MQTT client's buffer, so its strings aren't copied
+// and the command is decoded without any allocations.
+bool decode_command(const char *topic, byte *payload, unsigned int length, StaticMQTTJsonDocument &doc, command::Command &cmd)
+{
+  return deserialize_message(topic, payload, length, doc) && parse_command(doc, cmd);
+}
+
+// Presses `op` for the shutter of `cmd` at `at` and returns when it was actually pressed.
+platform::Clock::time_point press_at(size_t icontroller, ShutterIndex shutter, const command::Command &cmd, command::Op op,
+                                     platform::Clock::time_point at)
+{
+  auto &controller = CONTROLLERS[icontroller];
+  platform::Clock::time_point pressed_at;
+  switch (op)
+  {
+  case command::Op::Up:
+    pressed_at = controller.roll_up_at(shutter, at);
+    break;
+  case command::Op::Down:
+    pressed_at = controller.roll_down_at(shutter, at);
+    break;
+  default:
+    pressed_at = controller.roll_stop_at(shutter, at);
+    break;
+  }
+
+  if (cmd.shutter < TRACKED_SHUTTERS)
+  {
+    g_positions[cmd.shutter].press(op, pressed_at, shutter_model(cmd), POSITION_ERROR_PER_MOVE);
+    const auto tracker = g_positions[cmd.shutter];
+    g_snapshot.update([&](StateSnapshot &state) { state.shutters[cmd.shutter] = tracker; });
+    store_shutter_position(cmd.shutter);
+  }
+  return pressed_at;
+}
+
+platform::Clock::time_point press(size_t icontroller, ShutterIndex shutter, const command::Command &cmd, command::Op op)
+{
+  return press_at(icontroller, shutter, cmd, op, time_now());
+}
+
+// Turns an absolute move into a relative one starting at `at` from the estimated position of the shutter.
+// The time it rolls for comes from the model of the shutter so it stops at the target without correcting afterwards.
+// A move to either end isn't stopped at all, the shutter runs into the end stop however far off the estimate is
+// and where it is is known again afterwards.
+// The time of the command is zero if there's nothing to do.
+// Returns false if the estimate isn't good enough and the shutter has to go to the end stop first.
+bool make_incremental(command::Command &cmd, platform::Clock::time_point at)
+{
+  if (cmd.shutter >= TRACKED_SHUTTERS)
+    return false;
+
+  const auto &tracker = g_positions[cmd.shutter];
+  if (tracker.rolling(at))
+    return false;
+
+  const float fraction = cmd.total_time > chrono_ms::zero() ? (float)cmd.time.count() / cmd.total_time.count() : 0;
+  const auto target = std::min(std::max(cmd.op == command::Op::Down ? fraction : 1 - fraction, 0.0f), 1.0f);
+  if (target == 0 || target == 1)
+  {
+    const auto there = tracker.position(at) == target && tracker.uncertainty(at) == 0;
+    cmd.op = target == 1 ? command::Op::Down : command::Op::Up;
+    cmd.mode = there ? command::Mode::Relative : command::Mode::Default;
+    cmd.time = there ? command::Millis::zero() : cmd.total_time;
+    return true;
+  }
+
+  if (tracker.uncertainty(at) + POSITION_ERROR_PER_MOVE > POSITION_REHOME_THRESHOLD)
+    return false;
+
+  cmd.op = target > tracker.position(at) ? command::Op::Down : command::Op::Up;
+  cmd.mode = command::Mode::Relative;
+  cmd.time = tracker.time_to(target, at, shutter_model(cmd));
+  return true;
+}
+
+// Rest of an absolute move once the shutter reached the end stop.
+// It's planned from the estimated position when it's due, shutters which aren't tracked roll for the time as given.
+command::Command second_phase(command::Command cmd)
+{
+  cmd.mode = cmd.shutter < TRACKED_SHUTTERS ? command::Mode::Absolute : command::Mode::Relative;
+  return cmd;
+}
+
+void run_scheduled_command(size_t icontroller, platform::Clock::time_point at, const ScheduledCommand &scheduled);
+
+void schedule_command(size_t icontroller, platform::Clock::time_point at, const ScheduledCommand &scheduled)
+{
+  if (g_scheduled_commands[icontroller].schedule(at, scheduled))
+  {
+    metrics::g_registry.count(metrics::Counter::Scheduled);
     return;
   }
 
-  const char *mode = doc["mode"] | "default";
-  if (strcmp(mode, "absolute") == 0)
+  // too many moves in progress, wait for this one instead
+  metrics::g_registry.count(metrics::Counter::ScheduleFull);
+  Serial.print("no timer left, waiting for shutter: ");
+  Serial.println(scheduled.command.shutter);
+  platform::sleep_until(at - CONTROLLERS[icontroller].selection_lead(scheduled.shutter));
+  run_scheduled_command(icontroller, at, scheduled);
+}
+
+// Presses the button for the start of the command.
+// The rest of a timed move is scheduled so the controller is free while the shutter is rolling.
+void start_command(size_t icontroller, ShutterIndex shutter, const command::Command &cmd)
+{
+  if (cmd.mode == command::Mode::Absolute)
   {
-    const auto time = double_seconds_to_chrono_ms(doc["time"]);
-    const auto total_time = double_seconds_to_chrono_ms(doc["total_time"] | DEFAULT_TOTAL_TIME);
-    const shutter::ShutterProfile profile{shutter, total_time};
+    auto incremental = cmd;
+    if (make_incremental(incremental, time_now()))
+    {
+      if (incremental.time > chrono_ms::zero())
+        start_command(icontroller, shutter, incremental);
+      return;
+    }
 
-    if (roll_up)
-      controller->roll_from_bottom(profile, time);
-    else
-      controller->roll_from_top(profile, time);
+    // roll to the opposite end stop first, from wherever it is and with the slats turning
+    const auto rolling = command::opposite(cmd.op);
+    press(icontroller, shutter, cmd, rolling);
+
+    const auto full_travel = shutter_model(cmd).press_time(rolling == command::Op::Down ? 1 : -1, true, 1);
+    schedule_command(icontroller, time_now() + full_travel, ScheduledCommand{shutter, second_phase(cmd), rolling});
+    return;
+  }
+
+  const auto pressed_at = press(icontroller, shutter, cmd, cmd.op);
+  if (cmd.op != command::Op::Stop && cmd.mode == command::Mode::Relative)
+  {
+    auto stop = cmd;
+    stop.op = command::Op::Stop;
+    stop.mode = command::Mode::Default;
+    schedule_command(icontroller, pressed_at + cmd.time, ScheduledCommand{shutter, stop, cmd.op});
+  }
+}
+
+void run_scheduled_command(size_t icontroller, platform::Clock::time_point at, const ScheduledCommand &scheduled)
+{
+  auto cmd = scheduled.command;
+  if (cmd.mode == command::Mode::Absolute)
+  {
+    // the shutter is at the end stop now, so where it is is known
+    if (!make_incremental(cmd, at))
+      cmd.mode = command::Mode::Relative;
+    else if (cmd.time == chrono_ms::zero())
+      return;
   }
-  else if (strcmp(mode, "relative") == 0)
+
+  const auto pressed_at = press_at(icontroller, scheduled.shutter, cmd, cmd.op, at);
+  metrics::g_registry.record(metrics::Phase::Late, pressed_at - at);
+
+  if (cmd.op != command::Op::Stop && cmd.mode == command::Mode::Relative)
+  {
+    auto stop = cmd;
+    stop.op = command::Op::Stop;
+    stop.mode = command::Mode::Default;
+    schedule_command(icontroller, pressed_at + cmd.time, ScheduledCommand{scheduled.shutter, stop, cmd.op});
+  }
+}
+
+// Folds a relative move into the move of the same shutter which is in progress.
+void fold_into_scheduled(size_t icontroller, ScheduledCommands::Timer &pending, const command::Command &cmd)
+{
+  auto &timers = g_scheduled_commands[icontroller];
+  auto &scheduled = pending.item;
+  pending.context = platform::Context::current();
+
+  // what's left of the move in progress expressed as a command starting now
+  auto rest = scheduled.command;
+  if (scheduled.command.op == command::Op::Stop)
   {
-    const auto time = double_seconds_to_chrono_ms(doc["time"] | DEFAULT_RELATIVE_TIME);
+    const auto now = time_now();
+    rest.op = scheduled.rolling;
+    rest.mode = command::Mode::Relative;
+    rest.time = pending.at > now ? std::chrono::duration_cast<chrono_ms>(pending.at - now) : chrono_ms::zero();
 
-    if (roll_up)
-      controller->roll_up(shutter, time);
+    const auto shutter = scheduled.shutter;
+    const auto merge = command::coalesce(rest, cmd);
+    if (merge != queue::Merge::Cancel && rest.op == scheduled.rolling)
+    {
+      pending.at = now + rest.time;
+      return;
+    }
+
+    timers.cancel(&pending);
+    if (merge == queue::Merge::Cancel)
+      press(icontroller, shutter, cmd, command::Op::Stop);
     else
-      controller->roll_down(shutter, time);
+      start_command(icontroller, shutter, rest);
+    return;
   }
+
+  // the shutter is rolling to an end stop before the second phase
+  rest.mode = command::Mode::Absolute;
+  if (scheduled.command.mode == command::Mode::Default)
+    rest.time = rest.total_time;
+
+  command::coalesce(rest, cmd);
+  if (rest.mode == command::Mode::Absolute)
+  {
+    scheduled.command = second_phase(scheduled.command);
+    scheduled.command.time = rest.time;
+  }
+  else if (rest.op == scheduled.command.op)
+    scheduled.command.mode = command::Mode::Default;
   else
+    // it's already rolling to where it should end up
+    timers.cancel(&pending);
+}
+
+void execute_command(size_t icontroller, ShutterIndex shutter, const command::Command &cmd)
+{
+  auto &timers = g_scheduled_commands[icontroller];
+  auto pending = timers.find([shutter](const ScheduledCommands::Timer &timer) { return timer.item.shutter == shutter; });
+  if (pending)
+  {
+    if (cmd.mode == command::Mode::Relative)
+    {
+      fold_into_scheduled(icontroller, *pending, cmd);
+      return;
+    }
+    // anything else supersedes the move in progress
+    timers.cancel(pending);
+  }
+
+  start_command(icontroller, shutter, cmd);
+}
+
+void reject_command(const command::Command &cmd)
+{
+  Serial.print("command queue full, rejecting command for shutter: ");
+  Serial.println(cmd.shutter);
+  metrics::g_registry.count(metrics::Counter::Rejected);
+  publish_shutter_event("rejected", cmd);
+}
+
+void expire_command(const command::Command &cmd)
+{
+  Serial.print("command expired, dropping command for shutter: ");
+  Serial.println(cmd.shutter);
+  metrics::g_registry.count(metrics::Counter::Expired);
+  publish_shutter_event("expired", cmd);
+}
+
+// Time by which a command which arrived at `received_at` has to be started,
+// from the Unix time it was "issued_at" and the seconds it's good for ("ttl").
+// A command which has only one of them is good for COMMAND_DEFAULT_TTL after it was issued or `ttl` after it arrived.
+// Without either it never expires, nor does a command which only has "issued_at" while the wall clock isn't set yet.
+// The wall clock only tells how much of the ttl is left on arrival, the deadline itself is on the steady clock
+// so it isn't moved when the wall clock is set.
+platform::Clock::time_point command_deadline(const StaticMQTTJsonDocument &doc, platform::Clock::time_point received_at)
+{
+  const uint32_t issued_at = doc["issued_at"] | 0u;
+  const bool has_ttl = !doc["ttl"].isNull();
+  if (issued_at == 0 && !has_ttl)
+    return platform::Clock::time_point::max();
+
+  auto ttl = std::min(doc["ttl"] | (double)COMMAND_DEFAULT_TTL, (double)UINT32_MAX);
+  const auto now = platform::unix_time();
+  if (issued_at != 0 && now != 0)
+    // a command from the future is counted from now
+    ttl -= std::max(now - issued_at, 0.0);
+  else if (!has_ttl)
+    return platform::Clock::time_point::max();
+
+  return received_at + std::chrono::duration_cast<platform::Clock::duration>(std::chrono::duration<double>(ttl));
+}
+
+// Queues the commands for a controller all at once, coalescing them with the commands for the same shutter which are still waiting.
+// Every command that won't be transmitted on its own because of this is reported as superseded.
+// Returns how many of them were queued, the others are rejected.
+size_t queue_commands(size_t icontroller, const QueuedCommand *commands, size_t count)
+{
+  command::Command superseded[3 * COMMAND_QUEUE_SIZE];
+  size_t superseded_count = 0;
+  bool pushed[COMMAND_QUEUE_SIZE];
+
+  g_command_queues[icontroller].try_push(
+      commands, count, [&](QueuedCommand &pending, const QueuedCommand &next) {
+        const auto original = pending.command;
+        const auto merge = command::coalesce(pending.command, next.command);
+        // what's left of both is as good as the newer one
+        if (merge == queue::Merge::Absorb)
+          pending.expires_at = std::max(pending.expires_at, next.expires_at);
+        if (merge == queue::Merge::Drop || merge == queue::Merge::Cancel)
+          superseded[superseded_count++] = original;
+        if (merge == queue::Merge::Absorb || merge == queue::Merge::Cancel)
+          superseded[superseded_count++] = next.command;
+        return merge;
+      },
+      [](const QueuedCommand &queued) { return (uint8_t)queued.command.priority; },
+      pushed);
+
+  if (g_command_queues[icontroller].top_lane() > (uint8_t)command::Priority::Normal)
+    CONTROLLERS[icontroller].interrupt();
+  g_snapshot.update([icontroller](StateSnapshot &state) { state.controllers[icontroller].queued = g_command_queues[icontroller].size(); });
+
+  metrics::g_registry.count(metrics::Counter::Superseded, superseded_count);
+  for (size_t i = 0; i < superseded_count; i++)
+    publish_shutter_event("superseded", superseded[i]);
+
+  size_t queued = 0;
+  for (size_t i = 0; i < count; i++)
   {
-    if (roll_up)
-      controller->roll_up(shutter);
+    if (pushed[i])
+      queued++;
     else
-      controller->roll_down(shutter);
+      reject_command(commands[i].command);
+  }
+  return queued;
+}
+
+// Calls `fn(shutter)` for every shutter a command addresses.
+// That's either a single "shutter", a list of "shutters", "shutters": "all" or all shutters from "from" to "to" (inclusive).
+// The document must have passed `check_shutters`.
+template <typename F>
+void for_each_shutter(const StaticMQTTJsonDocument &doc, F fn)
+{
+  JsonArrayConst shutters = doc["shutters"];
+  if (strcmp(doc["shutters"] | "", "all") == 0)
+  {
+    for (unsigned int shutter = 0; shutter < TOTAL_SHUTTERS; shutter++)
+      fn(shutter);
+  }
+  else if (!shutters.isNull())
+  {
+    for (JsonVariantConst shutter : shutters)
+      fn(shutter.as<uint8_t>());
+  }
+  else if (!doc["from"].isNull())
+  {
+    const uint8_t last = doc["to"];
+    for (unsigned int shutter = doc["from"]; shutter <= last; shutter++)
+      fn(shutter);
   }
-  update_controller_selections();
+  else
+    fn(doc["shutter"].as<uint8_t>());
+}
+
+// Seconds in the document, rounded to the hundredths a model keeps, or `fallback` if it's not there.
+uint16_t model_time(JsonVariantConst value, uint16_t fallback)
+{
+  if (value.isNull())
+    return fallback;
+  return std::min(std::max(std::round(value.as<double>() * 100), 0.0), (double)UINT16_MAX - 1);
+}
+
+// Calibrates how the shutters addressed by the document move, see `position::Model`.
+// Times are given in seconds as "down_time", "up_time", "start_latency" and "tilt_time", the ones left out stay as they were.
+// If only one of the travel times is known it's used both ways, setting both to 0 goes back to the total time of every command.
+void set_models(const StaticMQTTJsonDocument &doc)
+{
+  for_each_shutter(doc, [&](uint8_t shutter) {
+    if (shutter >= TRACKED_SHUTTERS)
+    {
+      Serial.print("shutter isn't tracked, can't calibrate: ");
+      Serial.println(shutter);
+      return;
+    }
+
+    position::Model model;
+    {
+      std::lock_guard<platform::Mutex> guard(g_state_lock);
+      auto &stored = g_state.models[shutter];
+      model = stored.calibrated() ? stored : position::Model{0, 0, 0, 0};
+      model.down_cs = model_time(doc["down_time"], model.down_cs);
+      model.up_cs = model_time(doc["up_time"], model.up_cs);
+      model.start_latency_cs = model_time(doc["start_latency"], model.start_latency_cs);
+      model.tilt_cs = model_time(doc["tilt_time"], model.tilt_cs);
+      if (model.down_cs == 0)
+        model.down_cs = model.up_cs;
+      if (model.up_cs == 0)
+        model.up_cs = model.down_cs;
+
+      if (memcmp(&stored, &model, sizeof(model)) != 0)
+      {
+        stored = model;
+        mark_state_dirty();
+      }
+    }
+
+    StaticJsonDocument<JSON_OBJECT_SIZE(4)> published;
+    if (model.calibrated())
+    {
+      published["down_time"] = model.down_cs / 100.0;
+      published["up_time"] = model.up_cs / 100.0;
+      published["start_latency"] = model.start_latency_cs / 100.0;
+      published["tilt_time"] = model.tilt_cs / 100.0;
+    }
+    char topic_buf[40];
+    snprintf(topic_buf, sizeof(topic_buf), "ewfs/shutters/%u/model", shutter);
+    publish_document(topic_buf, published, true);
+  });
+}
+
+// What became of a command, counted over the shutters it addressed.
+struct DispatchResult
+{
+  uint16_t queued;
+  uint16_t rejected;
+  uint16_t expired;
+};
+
+// Splits the command up by controller and queues it for every shutter the document addresses.
+DispatchResult dispatch_command(const StaticMQTTJsonDocument &doc, command::Command cmd)
+{
+  DispatchResult result = {};
+  const auto received_at = time_now();
+  const auto expires_at = command_deadline(doc, received_at);
+
+  // a group of shutters is split up by controller so each one can plan its sweep at once
+  QueuedCommand batches[CONTROLLER_COUNT][COMMAND_QUEUE_SIZE];
+  size_t batch_sizes[CONTROLLER_COUNT] = {};
+
+  for_each_shutter(doc, [&](uint8_t global_shutter) {
+    Serial.printf("OP: %s | SHUTTER: %u\n", command::op_name(cmd.op), global_shutter);
+    cmd.shutter = global_shutter;
+
+    ShutterIndex shutter = global_shutter;
+    const auto controller = get_controller(&shutter);
+    if (!controller)
+    {
+      Serial.print("invalid shutter: ");
+      Serial.println(global_shutter);
+      result.rejected++;
+      return;
+    }
+
+    // i.e. held up by the broker while the board was offline
+    if (expires_at <= received_at)
+    {
+      expire_command(cmd);
+      result.expired++;
+      return;
+    }
+
+    const size_t icontroller = controller - CONTROLLERS;
+    auto &batch_size = batch_sizes[icontroller];
+    if (batch_size == COMMAND_QUEUE_SIZE)
+    {
+      reject_command(cmd);
+      result.rejected++;
+      return;
+    }
+    batches[icontroller][batch_size++] = QueuedCommand{shutter, cmd, received_at, expires_at};
+  });
+
+  for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+    if (batch_sizes[icontroller] > 0)
+    {
+      const auto queued = queue_commands(icontroller, batches[icontroller], batch_sizes[icontroller]);
+      result.queued += queued;
+      result.rejected += batch_sizes[icontroller] - queued;
+    }
+  return result;
 }
 
 void on_mqtt_message(char *topic, byte *payload, unsigned int length)
 {
-  StaticMQTTJsonDocument doc;
-  const auto err = deserializeJson(doc, payload, length);
-  if (err)
+  trace::g_recorder.command(topic, payload, length);
+  if (strcmp(topic, "ewfs/state/get") == 0)
   {
-    Serial.print("failed to deserialize message: ");
-    Serial.println(err.c_str());
+    publish_snapshot();
     return;
   }
 
-  try
+  if (strncmp(topic, "ewfs/model/set", strlen("ewfs/model/set")) == 0)
   {
-    std::thread(handle_command, doc).detach();
+    StaticMQTTJsonDocument doc;
+    if (deserialize_message(topic, payload, length, doc) && check_shutters(doc))
+      set_models(doc);
+    return;
   }
-  catch (const std::exception &e)
+
+  metrics::Timed timed(metrics::Phase::Receive);
+  StaticMQTTJsonDocument doc;
+  command::Command cmd;
+  if (decode_command(topic, payload, length, doc, cmd))
+    dispatch_command(doc, cmd);
+}
+
+#ifdef UDP_COMMAND_PORT
+// Answers a datagram in the format it came in, see `udp.hpp`.
+void send_udp_ack(const udp::Sender &sender, const udp::Ack &ack, bool msgpack)
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(5)> doc;
+  doc["seq"] = ack.seq;
+  doc["queued"] = ack.queued;
+  doc["rejected"] = ack.rejected;
+  doc["expired"] = ack.expired;
+  if (ack.invalid)
+    doc["invalid"] = true;
+
+  char buffer[64];
+  const auto length = msgpack ? serializeMsgPack(doc, buffer, sizeof(buffer)) : serializeJson(doc, buffer, sizeof(buffer));
+  g_udp.send(sender.address, sender.port, (const uint8_t *)buffer, length);
+}
+
+// Takes the command in a datagram down the same way as one from "ewfs/command".
+void on_udp_datagram(const udp::Sender &sender, uint8_t *payload, size_t length)
+{
+  const auto msgpack = udp::is_msgpack(payload, length);
+  // recorded as if it came from the broker so replaying the trace schedules it the same way
+  const auto topic = msgpack ? "ewfs/command" MSGPACK_SUFFIX : "ewfs/command";
+  trace::g_recorder.command(topic, payload, length);
+
+  metrics::Timed timed(metrics::Phase::Receive);
+  StaticMQTTJsonDocument doc;
+  if (!deserialize_message(topic, payload, length, doc))
+    return;
+  if (doc["seq"].isNull())
   {
-    Serial.print("failed to handle command: ");
-    Serial.println(e.what());
+    Serial.println("UDP command without sequence number");
     return;
   }
+
+  udp::Ack ack = {doc["seq"].as<uint32_t>(), 0, 0, 0, false};
+  if (!g_udp_senders.repeated(sender, ack))
+  {
+    command::Command cmd;
+    if (parse_command(doc, cmd))
+    {
+      const auto result = dispatch_command(doc, cmd);
+      ack.queued = result.queued;
+      ack.rejected = result.rejected;
+      ack.expired = result.expired;
+    }
+    else
+      ack.invalid = true;
+    g_udp_senders.remember(sender, ack);
+  }
+  send_udp_ack(sender, ack, msgpack);
+}
+
+// Handles every datagram which arrived since the last call.
+void poll_udp()
+{
+  // commands are held to the size they may have over MQTT, one more byte tells those which are larger apart
+  uint8_t payload[MQTT_MAX_PACKET_SIZE + 1];
+  udp::Sender sender;
+  size_t length;
+  while ((length = g_udp.receive(payload, sizeof(payload), sender.address, sender.port)) > 0)
+  {
+    if (length > MQTT_MAX_PACKET_SIZE)
+    {
+      Serial.println("UDP command too large");
+      continue;
+    }
+    on_udp_datagram(sender, payload, length);
+  }
+}
+#endif
+
+// Picks the queued command to execute next so the selector takes the shortest way past all of them.
+size_t pick_command(size_t icontroller, const QueuedCommand *const *pending, size_t count)
+{
+  ShutterIndex targets[COMMAND_QUEUE_SIZE];
+  for (size_t i = 0; i < count; i++)
+    targets[i] = pending[i]->shutter;
+
+  const auto stop = scheduler::first_stop(CONTROLLERS[icontroller].get_selected_shutter(), CONTROLLERS[icontroller].total_shutters(), targets, count);
+  // commands for the same shutter must stay in order
+  size_t position = 0;
+  while (targets[position] != targets[stop])
+    position++;
+
+  return position;
+}
+
+void run_command_worker(size_t icontroller)
+{
+  auto &controller = CONTROLLERS[icontroller];
+  auto &queue = g_command_queues[icontroller];
+  auto &timers = g_scheduled_commands[icontroller];
+
+  // the shutter has to be selected ahead of a scheduled press
+  const auto wake_at = [&controller](const ScheduledCommands::Timer &timer) {
+    return timer.at - controller.selection_lead(timer.item.shutter);
+  };
+
+  while (true)
+  {
+    const auto next = timers.earliest(wake_at);
+    const auto deadline = next ? wake_at(*next) : platform::Clock::time_point::max();
+
+    QueuedCommand queued;
+    const auto popped = queue.pop_until(
+        deadline,
+        [&](const QueuedCommand *const *pending, size_t count) {
+          // expired commands are taken out first, dropping them doesn't touch the controller
+          for (size_t i = 0; i < count; i++)
+            if (pending[i]->expires_at <= time_now())
+              return i;
+
+          const auto position = pick_command(icontroller, pending, count);
+          // don't start anything that would hold up the next scheduled press, unless it's urgent
+          if (next && pending[position]->command.priority == command::Priority::Normal &&
+              time_now() + controller.command_duration(pending[position]->shutter) > deadline)
+            return count;
+          return position;
+        },
+        COMMAND_MAX_BYPASS, queued);
+
+    // an urgent command which is still waiting keeps interrupting
+    controller.clear_interrupt();
+    if (queue.top_lane() > (uint8_t)command::Priority::Normal)
+      controller.interrupt();
+
+    if (popped && queued.expires_at <= time_now())
+    {
+      expire_command(queued.command);
+      update_controller_status(icontroller, nullptr);
+      continue;
+    }
+
+    const auto occupied_since = time_now();
+    if (popped)
+    {
+      metrics::g_registry.record(metrics::Phase::Queue, time_now() - queued.queued_at);
+      controller.set_interruptible(queued.command.priority == command::Priority::Normal);
+      update_controller_status(icontroller, &queued.command);
+      execute_command(icontroller, queued.shutter, queued.command);
+    }
+    else
+    {
+      // a scheduled stop has to get through
+      controller.set_interruptible(false);
+      const auto at = next->at;
+      const auto scheduled = timers.take(next);
+      update_controller_status(icontroller, &scheduled.command);
+      run_scheduled_command(icontroller, at, scheduled);
+    }
+    update_controller_status(icontroller, nullptr);
+    update_controller_selections();
+    g_worker_occupied_ms[icontroller] += std::chrono::duration_cast<std::chrono::milliseconds>(time_now() - occupied_since).count();
+  }
 }
 
 void panic(std::string msg)
@@ -248,36 +1596,75 @@ void panic(std::string msg)
 
 void set_thread_config()
 {
-  esp_pthread_cfg_t cfg{8 * 1024, 0, true};
+  auto cfg = esp_pthread_get_default_config();
+  cfg.stack_size = 8 * 1024;
+  cfg.inherit_cfg = true;
   if (esp_pthread_set_cfg(&cfg) != ESP_OK)
   {
     panic("failed to set pthread config");
   }
 }
 
-void setup()
+void start_command_workers()
 {
-  EEPROM.begin(EEPROM_SELECTION_SIZE);
+  try
+  {
+    bool spawned = true;
+    for (size_t icontroller = 0; icontroller < CONTROLLER_COUNT; icontroller++)
+    {
+      spawned &= g_tasks.spawn(
+          COMMAND_WORKERS[icontroller], [](void *arg) { run_command_worker((size_t)arg); }, (void *)icontroller);
+    }
+    spawned &= g_tasks.spawn(
+        STATE_WRITER_TASK, [](void *) { run_state_writer(); }, nullptr);
+    if (!spawned)
+      panic("no room for the command workers");
+  }
+  catch (const std::exception &e)
+  {
+    panic(std::string("failed to start command workers: ") + e.what());
+  }
+}
 
+void setup()
+{
+#if defined(TRACE_TOPIC) || defined(TRACE_SERIAL)
+  trace::g_recorder.enable();
+#endif
   led::setup();
+  pulse::g_engine.setup();
 
   for (auto &c : CONTROLLERS)
   {
     c.setup();
   }
 
+  load_state();
   load_controller_selections();
+  load_shutter_positions();
+  init_snapshot();
 
+#ifdef TRACE_SERIAL
+  // room for a whole trace line besides the UART's FIFO
+  Serial.setTxBufferSize(TRACE_LINE_SIZE);
+#endif
   Serial.begin(9600);
   Serial.println();
 
   set_thread_config();
+  g_tasks.adopt(LOOP_TASK);
+  start_command_workers();
 
+  g_wifi_client.setTimeout(MQTT_CONNECT_TIMEOUT_S);
+  g_mqtt_client.setSocketTimeout(MQTT_CONNECT_TIMEOUT_S);
   g_mqtt_client.setServer(MQTT_SERVER_DOMAIN, MQTT_SERVER_PORT);
   g_mqtt_client.setCallback(on_mqtt_message);
 
   Serial.println("\nready");
   led::flash_ok();
+#ifdef METRICS_PUBLISH_INTERVAL_MS
+  g_heap_setup_free = platform::free_heap();
+#endif
 
 #ifdef TESTING
   test();
@@ -286,15 +1673,29 @@ void setup()
 
 void loop()
 {
-  if (WiFi.status() != WL_CONNECTED)
-  {
-    connect_wifi();
+  poll_connection();
+#ifdef UDP_COMMAND_PORT
+  // the broker isn't needed for these
+  if (g_connection_state == connection::State::MqttDown || g_connection_state == connection::State::Connected)
+    poll_udp();
+#endif
+#if defined(TRACE_TOPIC) || defined(TRACE_SERIAL)
+  stream_trace();
+#endif
+  if (g_connection_state != connection::State::Connected)
     return;
-  }
 
-  if (!g_mqtt_client.loop())
+  publish_shutter_events();
+  publish_changed_state();
+#ifdef METRICS_PUBLISH_INTERVAL_MS
+  if (time_now() >= g_metrics_due)
   {
-    connect_mqtt();
-    return;
+    g_metrics_due = time_now() + std::chrono::milliseconds(METRICS_PUBLISH_INTERVAL_MS);
+    publish_metrics();
   }
+#endif
 }
+
+#ifdef SIMULATOR
+#include <bench.hpp>
+#endif
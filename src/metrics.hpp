@@ -0,0 +1,227 @@
+#ifndef metrics_ns
+#define metrics_ns
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <platform.hpp>
+
+namespace metrics
+{
+    // Parts of the life of a command whose duration is recorded.
+    enum class Phase : uint8_t
+    {
+        // handling of an incoming MQTT message, from parsing to queueing its commands
+        Receive,
+        // from being queued until a worker starts executing the command
+        Queue,
+        // waiting for a controller which is busy with another shutter
+        LockWait,
+        // waiting to be sure the selection of the remote went inactive
+        SelectionGuard,
+        // stepping through shutters until the right one is selected
+        Selecting,
+        // holding down the command button, including the gaps between repeats
+        Pressing,
+        // how much later than planned a scheduled press happened
+        Late,
+        // writing the state to flash
+        Persist,
+        // publishing a message
+        Publish,
+    };
+
+    const size_t PHASE_COUNT = 9;
+
+    const char *const PHASE_NAMES[PHASE_COUNT] = {
+        "receive",
+        "queue",
+        "lock_wait",
+        "selection_guard",
+        "selecting",
+        "pressing",
+        "late",
+        "persist",
+        "publish",
+    };
+
+    enum class Counter : uint8_t
+    {
+        // a controller was busy when it was needed
+        LockContended,
+        // the end of a move was scheduled instead of being waited for
+        Scheduled,
+        // no timer was free and the worker had to wait for the end of a move
+        ScheduleFull,
+        Rejected,
+        Superseded,
+        // a selection press which the LED showed didn't get through
+        SelectionCorrected,
+        // repeats of a press which were left out for an urgent command
+        Interrupted,
+        // commands dropped because they were past their deadline
+        Expired,
+    };
+
+    const size_t COUNTER_COUNT = 8;
+
+    const char *const COUNTER_NAMES[COUNTER_COUNT] = {
+        "lock_contended",
+        "scheduled",
+        "schedule_full",
+        "rejected",
+        "superseded",
+        "selection_corrected",
+        "interrupted",
+        "expired",
+    };
+
+    // Bucket 0 holds durations below 1 ms, bucket i those from 2^(i-1) up to 2^i ms
+    // and the last one everything longer.
+    const size_t BUCKETS = 20;
+
+    // Histogram of durations with a fixed number of logarithmic buckets.
+    // Recording is lock-free so it can be done from any task.
+    class Histogram
+    {
+        std::atomic<uint32_t> m_buckets[BUCKETS];
+        std::atomic<uint32_t> m_count;
+        std::atomic<uint32_t> m_total_ms;
+        std::atomic<uint32_t> m_max_ms;
+
+    public:
+        Histogram() : m_buckets(), m_count(0), m_total_ms(0), m_max_ms(0){};
+
+        static size_t bucket(uint32_t ms)
+        {
+            size_t bucket = 0;
+            while (ms > 0 && bucket < BUCKETS - 1)
+            {
+                ms >>= 1;
+                bucket++;
+            }
+            return bucket;
+        }
+
+        // Longest duration which falls into the bucket.
+        static uint32_t bucket_limit(size_t bucket)
+        {
+            return bucket < BUCKETS - 1 ? (1u << bucket) - 1 : UINT32_MAX;
+        }
+
+        void record(uint32_t ms)
+        {
+            m_buckets[bucket(ms)]++;
+            m_count++;
+            m_total_ms += ms;
+
+            auto max = m_max_ms.load();
+            while (ms > max && !m_max_ms.compare_exchange_weak(max, ms))
+            {
+            }
+        }
+
+        uint32_t count() const
+        {
+            return m_count;
+        }
+
+        uint32_t total_ms() const
+        {
+            return m_total_ms;
+        }
+
+        uint32_t max_ms() const
+        {
+            return m_max_ms;
+        }
+
+        uint32_t bucket_count(size_t bucket) const
+        {
+            return m_buckets[bucket];
+        }
+
+        // Upper bound of the duration below which the fraction `p` of the recordings lies.
+        uint32_t percentile_ms(float p) const
+        {
+            const uint32_t rank = p * count();
+            uint32_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++)
+            {
+                seen += m_buckets[i];
+                if (seen > rank)
+                    return std::min(bucket_limit(i), max_ms());
+            }
+            return max_ms();
+        }
+    };
+
+    class Registry
+    {
+        Histogram m_phases[PHASE_COUNT];
+        std::atomic<uint32_t> m_counters[COUNTER_COUNT];
+
+    public:
+        Registry() : m_counters(){};
+
+        template <typename Rep, typename Period>
+        void record(Phase phase, std::chrono::duration<Rep, Period> duration)
+        {
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+            m_phases[(size_t)phase].record(ms > 0 ? ms : 0);
+        }
+
+        void count(Counter counter, uint32_t n = 1)
+        {
+            m_counters[(size_t)counter] += n;
+        }
+
+        const Histogram &phase(Phase phase) const
+        {
+            return m_phases[(size_t)phase];
+        }
+
+        uint32_t counter(Counter counter) const
+        {
+            return m_counters[(size_t)counter];
+        }
+    };
+
+    Registry g_registry;
+
+    // Records the time from its construction until it goes out of scope.
+    class Timed
+    {
+        Phase m_phase;
+        platform::Clock::time_point m_start;
+
+    public:
+        Timed(Phase phase) : m_phase(phase), m_start(platform::Clock::now()){};
+        Timed(const Timed &) = delete;
+        Timed &operator=(const Timed &) = delete;
+
+        ~Timed()
+        {
+            g_registry.record(m_phase, platform::Clock::now() - m_start);
+        }
+    };
+
+    // Locks the mutex, counting it as contended and recording the wait if it's held by someone else.
+    template <typename M>
+    std::unique_lock<M> lock(M &mutex)
+    {
+        std::unique_lock<M> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+        {
+            g_registry.count(Counter::LockContended);
+            Timed timed(Phase::LockWait);
+            lock.lock();
+        }
+        return lock;
+    }
+} // namespace metrics
+#endif
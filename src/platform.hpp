@@ -0,0 +1,577 @@
+#ifndef platform_ns
+#define platform_ns
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+
+namespace platform
+{
+    const int ANY_CORE = -1;
+
+    // Where and how urgently a task runs.
+    struct TaskConfig
+    {
+        const char *name;
+        // ANY_CORE lets the scheduler pick
+        int core;
+        // FreeRTOS priority, the Arduino loop runs at 1
+        uint8_t priority;
+        // in bytes, see the "stack_free" the tasks report to pick it
+        size_t stack_size;
+    };
+
+    // Sum of the stack sizes of `count` tasks.
+    constexpr size_t total_stack_size(const TaskConfig *configs, size_t count)
+    {
+        return count == 0 ? 0 : configs[0].stack_size + total_stack_size(configs + 1, count - 1);
+    }
+} // namespace platform
+
+// Threading and time primitives.
+// The simulator build swaps these out for its virtual clock.
+#ifdef SIMULATOR
+#include <sim.hpp>
+
+namespace platform
+{
+    using sim::Clock;
+    using sim::ConditionVariable;
+    using sim::Context;
+    using sim::Mutex;
+    using sim::Timer;
+    using sim::UdpSocket;
+    using sim::wire_selection_led;
+    using sim::sleep_for;
+    using sim::sleep_until;
+    using sim::spawn;
+
+    // Simulated tasks take turns on a single thread, there are no cores to pin them to
+    // and their stacks aren't the ones they'd have on the board, so there's nothing to measure.
+    template <size_t N, size_t STACK_BYTES>
+    class Tasks
+    {
+        const TaskConfig *m_configs[N];
+        size_t m_count;
+
+    public:
+        Tasks() : m_configs(), m_count(0){};
+
+        bool spawn(const TaskConfig &config, void (*fn)(void *), void *arg)
+        {
+            if (!adopt(config))
+                return false;
+            sim::spawn(fn, arg);
+            return true;
+        }
+
+        bool adopt(const TaskConfig &config)
+        {
+            if (m_count == N)
+                return false;
+            m_configs[m_count++] = &config;
+            return true;
+        }
+
+        size_t count() const
+        {
+            return m_count;
+        }
+
+        const TaskConfig &config(size_t i) const
+        {
+            return *m_configs[i];
+        }
+
+        size_t stack_free(size_t i) const
+        {
+            return 0;
+        }
+    };
+
+    inline size_t free_heap()
+    {
+        return 0;
+    }
+
+    inline size_t min_free_heap()
+    {
+        return 0;
+    }
+
+    inline void sync_wall_clock(const char *server)
+    {
+    }
+
+    inline double unix_time()
+    {
+        return sim::EPOCH_S + std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+    }
+} // namespace platform
+#else
+#include <sys/time.h>
+
+#include <Arduino.h>
+#include <esp_pthread.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+namespace platform
+{
+    // Time since the board started, from esp_timer. Unlike the system clock it's not stepped when the wall clock is set over NTP,
+    // everything which is timed runs on it and only `unix_time()` reads the wall clock.
+    struct Clock
+    {
+        typedef std::chrono::microseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<Clock> time_point;
+        static const bool is_steady = true;
+
+        static time_point now()
+        {
+            return time_point(duration(esp_timer_get_time()));
+        }
+    };
+#ifdef STATIC_ALLOCATION
+    // Mutex whose semaphore lives inside of it, std::mutex allocates one when it's first locked.
+    class Mutex
+    {
+        StaticSemaphore_t m_buffer;
+        SemaphoreHandle_t m_handle;
+
+    public:
+        Mutex() : m_handle(xSemaphoreCreateMutexStatic(&m_buffer)){};
+        Mutex(const Mutex &) = delete;
+        Mutex &operator=(const Mutex &) = delete;
+
+        void lock()
+        {
+            xSemaphoreTake(m_handle, portMAX_DELAY);
+        }
+
+        bool try_lock()
+        {
+            return xSemaphoreTake(m_handle, 0) == pdTRUE;
+        }
+
+        void unlock()
+        {
+            xSemaphoreGive(m_handle);
+        }
+    };
+
+    // Condition variable which doesn't allocate. The pthread one of ESP-IDF creates a semaphore for every wait,
+    // here every waiter brings its own on its stack and queues up until it's notified or gives up.
+    class ConditionVariable
+    {
+        struct Waiter
+        {
+            StaticSemaphore_t buffer;
+            SemaphoreHandle_t semaphore;
+            Waiter *next;
+        };
+
+        portMUX_TYPE m_mux;
+        Waiter *m_first;
+        Waiter *m_last;
+
+        // Takes `waiter` off the queue, returns false if a notifier got to it first.
+        bool _remove(Waiter *waiter)
+        {
+            Waiter *previous = nullptr;
+            for (auto w = m_first; w; previous = w, w = w->next)
+            {
+                if (w != waiter)
+                    continue;
+
+                (previous ? previous->next : m_first) = w->next;
+                if (m_last == w)
+                    m_last = previous;
+                return true;
+            }
+            return false;
+        }
+
+        // Returns false if `ticks` passed without a notification.
+        bool _wait(std::unique_lock<Mutex> &lock, TickType_t ticks)
+        {
+            Waiter waiter;
+            waiter.semaphore = xSemaphoreCreateBinaryStatic(&waiter.buffer);
+            waiter.next = nullptr;
+            portENTER_CRITICAL(&m_mux);
+            (m_last ? m_last->next : m_first) = &waiter;
+            m_last = &waiter;
+            portEXIT_CRITICAL(&m_mux);
+
+            lock.unlock();
+            auto notified = xSemaphoreTake(waiter.semaphore, ticks) == pdTRUE;
+            if (!notified)
+            {
+                portENTER_CRITICAL(&m_mux);
+                const auto removed = _remove(&waiter);
+                portEXIT_CRITICAL(&m_mux);
+                // the notifier is about to give the semaphore, it has to stay around until then
+                if (!removed)
+                    notified = xSemaphoreTake(waiter.semaphore, portMAX_DELAY) == pdTRUE;
+            }
+            lock.lock();
+            return notified;
+        }
+
+    public:
+        ConditionVariable() : m_mux(portMUX_INITIALIZER_UNLOCKED), m_first(nullptr), m_last(nullptr){};
+        ConditionVariable(const ConditionVariable &) = delete;
+        ConditionVariable &operator=(const ConditionVariable &) = delete;
+
+        void notify_one()
+        {
+            portENTER_CRITICAL(&m_mux);
+            const auto waiter = m_first;
+            if (waiter)
+            {
+                m_first = waiter->next;
+                if (!m_first)
+                    m_last = nullptr;
+            }
+            portEXIT_CRITICAL(&m_mux);
+            if (waiter)
+                xSemaphoreGive(waiter->semaphore);
+        }
+
+        void notify_all()
+        {
+            portENTER_CRITICAL(&m_mux);
+            auto waiter = m_first;
+            m_first = m_last = nullptr;
+            portEXIT_CRITICAL(&m_mux);
+            while (waiter)
+            {
+                // the waiter is gone as soon as it got the semaphore
+                const auto next = waiter->next;
+                xSemaphoreGive(waiter->semaphore);
+                waiter = next;
+            }
+        }
+
+        void wait(std::unique_lock<Mutex> &lock)
+        {
+            _wait(lock, portMAX_DELAY);
+        }
+
+        template <typename P>
+        void wait(std::unique_lock<Mutex> &lock, P pred)
+        {
+            while (!pred())
+                wait(lock);
+        }
+
+        template <typename D>
+        std::cv_status wait_until(std::unique_lock<Mutex> &lock, const std::chrono::time_point<Clock, D> &t)
+        {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(t - Clock::now()).count();
+            TickType_t ticks = 0;
+            if (remaining >= (int64_t)(portMAX_DELAY / 2) * portTICK_PERIOD_MS)
+                ticks = portMAX_DELAY;
+            else if (remaining > 0)
+                // rounded up so it doesn't wake just before the deadline
+                ticks = (remaining + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+            return _wait(lock, ticks) ? std::cv_status::no_timeout : std::cv_status::timeout;
+        }
+    };
+#else
+    typedef std::mutex Mutex;
+    typedef std::condition_variable ConditionVariable;
+#endif
+
+    // The simulator uses contexts to attribute work handed between tasks
+    // to the message that caused it. There's nothing to track on the device.
+    struct Context
+    {
+        static Context current()
+        {
+            return Context();
+        }
+
+        void adopt() const {}
+    };
+
+    // The simulator needs to know which remote lights the LED. On the board it's wired up.
+    inline void wire_selection_led(uint8_t led, std::initializer_list<uint8_t> buttons) {}
+
+    // One-shot timer calling `callback(arg)` from the esp_timer task once it expires.
+    class Timer
+    {
+        void (*m_callback)(void *);
+        void *m_arg;
+        esp_timer_handle_t m_handle;
+
+    public:
+        Timer(void (*callback)(void *), void *arg) : m_callback(callback), m_arg(arg), m_handle(nullptr){};
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        void setup()
+        {
+            esp_timer_create_args_t args = {};
+            args.callback = m_callback;
+            args.arg = m_arg;
+            args.dispatch_method = ESP_TIMER_TASK;
+            args.name = "platform";
+            ESP_ERROR_CHECK(esp_timer_create(&args, &m_handle));
+        }
+
+        // Replaces the previous expiry if the timer is still running.
+        void start_at(Clock::time_point at)
+        {
+            const auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(at - Clock::now());
+            stop();
+            esp_timer_start_once(m_handle, timeout.count() > 0 ? timeout.count() : 0);
+        }
+
+        void stop()
+        {
+            // fails if the timer isn't running which is fine
+            esp_timer_stop(m_handle);
+        }
+    };
+
+    // Non-blocking UDP socket straight on lwIP which reads into and sends from the caller's buffers.
+    // WiFiUDP copies every datagram into a buffer it allocates for it, this allocates nothing once it's bound.
+    // Addresses are IPv4 ones in network byte order.
+    class UdpSocket
+    {
+        int m_socket;
+
+    public:
+        UdpSocket() : m_socket(-1){};
+        UdpSocket(const UdpSocket &) = delete;
+        UdpSocket &operator=(const UdpSocket &) = delete;
+
+        // Binds to `port` on every interface, closing the previous socket.
+        bool begin(uint16_t port)
+        {
+            stop();
+            m_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (m_socket < 0)
+                return false;
+
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(port);
+            if (bind(m_socket, (const sockaddr *)&address, sizeof(address)) != 0)
+            {
+                stop();
+                return false;
+            }
+            return true;
+        }
+
+        void stop()
+        {
+            if (m_socket < 0)
+                return;
+            close(m_socket);
+            m_socket = -1;
+        }
+
+        // Reads the next datagram into `buffer` and returns its size, 0 if there's none.
+        // What doesn't fit is dropped so a datagram which fills the buffer may have been cut off.
+        size_t receive(uint8_t *buffer, size_t size, uint32_t &address, uint16_t &port)
+        {
+            if (m_socket < 0)
+                return 0;
+
+            sockaddr_in from;
+            socklen_t from_length = sizeof(from);
+            const auto length = recvfrom(m_socket, buffer, size, MSG_DONTWAIT, (sockaddr *)&from, &from_length);
+            if (length <= 0)
+                return 0;
+            address = from.sin_addr.s_addr;
+            port = ntohs(from.sin_port);
+            return length;
+        }
+
+        bool send(uint32_t address, uint16_t port, const uint8_t *data, size_t size)
+        {
+            if (m_socket < 0)
+                return false;
+
+            sockaddr_in to = {};
+            to.sin_family = AF_INET;
+            to.sin_addr.s_addr = address;
+            to.sin_port = htons(port);
+            return sendto(m_socket, data, size, 0, (const sockaddr *)&to, sizeof(to)) == (ssize_t)size;
+        }
+    };
+
+    template <typename Rep, typename Period>
+    inline void sleep_for(const std::chrono::duration<Rep, Period> &d)
+    {
+        std::this_thread::sleep_for(d);
+    }
+
+    template <typename C, typename D>
+    inline void sleep_until(const std::chrono::time_point<C, D> &t)
+    {
+        std::this_thread::sleep_until(t);
+    }
+
+    template <typename F, typename... Args>
+    inline void spawn(F &&f, Args &&...args)
+    {
+        std::thread(std::forward<F>(f), std::forward<Args>(args)...).detach();
+    }
+
+    // Tasks started with a configuration, kept track of to report how much of their stacks they never used.
+    // With STATIC_ALLOCATION they're FreeRTOS tasks whose stacks are carved out of `STACK_BYTES` reserved up front,
+    // otherwise they're pthreads.
+    template <size_t N, size_t STACK_BYTES>
+    class Tasks
+    {
+        struct Slot
+        {
+            const TaskConfig *config;
+            void (*fn)(void *);
+            void *arg;
+            // set by the task itself once it runs
+            std::atomic<TaskHandle_t> handle;
+        };
+
+        Slot m_slots[N];
+        size_t m_count;
+#ifdef STATIC_ALLOCATION
+        StaticTask_t m_blocks[N];
+        StackType_t m_stacks[STACK_BYTES];
+        size_t m_stack_used;
+#endif
+
+        static void _run(void *arg)
+        {
+            auto slot = static_cast<Slot *>(arg);
+            slot->handle = xTaskGetCurrentTaskHandle();
+            slot->fn(slot->arg);
+        }
+
+    public:
+#ifdef STATIC_ALLOCATION
+        Tasks() : m_slots(), m_count(0), m_stack_used(0){};
+#else
+        Tasks() : m_slots(), m_count(0){};
+#endif
+        Tasks(const Tasks &) = delete;
+        Tasks &operator=(const Tasks &) = delete;
+
+        // Starts `fn(arg)` as a task pinned to a core with the given priority and stack.
+        // Returns false if there's no room left for it.
+        // Without STATIC_ALLOCATION the pthread configuration is swapped for the duration of the call so this must not race with other spawns.
+        bool spawn(const TaskConfig &config, void (*fn)(void *), void *arg)
+        {
+            if (m_count == N)
+                return false;
+
+            auto &slot = m_slots[m_count];
+            slot.config = &config;
+            slot.fn = fn;
+            slot.arg = arg;
+#ifdef STATIC_ALLOCATION
+            // ESP-IDF counts stacks in bytes
+            if (m_stack_used + config.stack_size > STACK_BYTES)
+                return false;
+            const auto core = config.core == ANY_CORE ? tskNO_AFFINITY : config.core;
+            if (!xTaskCreateStaticPinnedToCore(_run, config.name, config.stack_size, &slot, config.priority,
+                                               &m_stacks[m_stack_used], &m_blocks[m_count], core))
+                return false;
+            m_stack_used += config.stack_size;
+#else
+            esp_pthread_cfg_t previous;
+            if (esp_pthread_get_cfg(&previous) != ESP_OK)
+                previous = esp_pthread_get_default_config();
+
+            auto cfg = previous;
+            cfg.thread_name = config.name;
+            cfg.pin_to_core = config.core == ANY_CORE ? tskNO_AFFINITY : config.core;
+            cfg.prio = config.priority;
+            cfg.stack_size = config.stack_size;
+            cfg.inherit_cfg = false;
+            ESP_ERROR_CHECK(esp_pthread_set_cfg(&cfg));
+
+            platform::spawn(_run, &slot);
+            esp_pthread_set_cfg(&previous);
+#endif
+            m_count++;
+            return true;
+        }
+
+        // Keeps track of the calling task which somebody else started, i.e. the Arduino loop.
+        bool adopt(const TaskConfig &config)
+        {
+            if (m_count == N)
+                return false;
+
+            auto &slot = m_slots[m_count++];
+            slot.config = &config;
+            slot.handle = xTaskGetCurrentTaskHandle();
+            return true;
+        }
+
+        size_t count() const
+        {
+            return m_count;
+        }
+
+        const TaskConfig &config(size_t i) const
+        {
+            return *m_slots[i].config;
+        }
+
+        // Bytes of the task's stack which were never used, 0 until it runs.
+        size_t stack_free(size_t i) const
+        {
+            const auto handle = m_slots[i].handle.load();
+            return handle ? uxTaskGetStackHighWaterMark(handle) : 0;
+        }
+    };
+
+    inline size_t free_heap()
+    {
+        return esp_get_free_heap_size();
+    }
+
+    // Lowest the free heap has been since the board started.
+    inline size_t min_free_heap()
+    {
+        return esp_get_minimum_free_heap_size();
+    }
+
+    // Anything earlier is the clock counting up from zero since the board started.
+    const time_t WALL_CLOCK_VALID_AFTER = 1577836800; // 2020-01-01
+
+    // Starts setting the wall clock over NTP in the background, it's kept in sync from then on.
+    inline void sync_wall_clock(const char *server)
+    {
+        configTime(0, 0, server);
+    }
+
+    // Seconds since the Unix epoch, 0 until the wall clock has been set.
+    inline double unix_time()
+    {
+        timeval now;
+        gettimeofday(&now, nullptr);
+        if (now.tv_sec < WALL_CLOCK_VALID_AFTER)
+            return 0;
+        return now.tv_sec + now.tv_usec / 1e6;
+    }
+} // namespace platform
+#endif
+#endif
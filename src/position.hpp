@@ -0,0 +1,204 @@
+#ifndef position_ns
+#define position_ns
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#include <command.hpp>
+#include <platform.hpp>
+#include <shutter.hpp>
+
+namespace position
+{
+    // How a shutter moves once one of its buttons is pressed.
+    // The motor starts `start_latency` after the press. If the slats are turned the other way they're tilted
+    // for `tilt_time` first, then the shutter travels at a constant speed, taking `down_time` or `up_time` all the way.
+    // It stops right when stop is pressed.
+    //
+    // Times are in hundredths of a second so the model of every shutter fits into the persisted state.
+    struct Model
+    {
+        uint16_t down_cs;
+        uint16_t up_cs;
+        uint16_t start_latency_cs;
+        uint16_t tilt_cs;
+
+        // A shutter which wasn't calibrated takes `total_time` both ways and starts right away.
+        static Model linear(chrono_ms total_time)
+        {
+            const uint16_t cs = std::min<long long>(std::max<long long>((total_time.count() + 5) / 10, 0), UINT16_MAX);
+            return Model{cs, cs, 0, 0};
+        }
+
+        // The persisted state is all 0xFF until the shutter is calibrated.
+        bool calibrated() const
+        {
+            return down_cs != 0 && down_cs != UINT16_MAX && up_cs != 0 && up_cs != UINT16_MAX;
+        }
+
+        // 1 down, -1 up
+        chrono_ms travel_time(int8_t direction) const
+        {
+            return chrono_ms(10 * (direction > 0 ? down_cs : up_cs));
+        }
+
+        // Time from pressing the button for `direction` until the shutter starts travelling.
+        chrono_ms delay(bool tilt) const
+        {
+            return chrono_ms(10 * (start_latency_cs + (tilt ? tilt_cs : 0)));
+        }
+
+        // Fraction of the full travel the shutter covered `elapsed` after the button for `direction` was pressed.
+        float travelled(int8_t direction, bool tilt, std::chrono::duration<float> elapsed) const
+        {
+            const std::chrono::duration<float> moving = elapsed - delay(tilt);
+            const std::chrono::duration<float> total = travel_time(direction);
+            if (moving.count() <= 0 || total.count() <= 0)
+                return 0;
+            return moving.count() / total.count();
+        }
+
+        // Inverse of `travelled`, the time after which stop has to be pressed so the shutter covers `distance`.
+        chrono_ms press_time(int8_t direction, bool tilt, float distance) const
+        {
+            return delay(tilt) + chrono_ms((long long)std::round(distance * travel_time(direction).count()));
+        }
+    };
+
+    // Estimates where a shutter is from the buttons pressed for it and when.
+    // Positions go from 0 (all the way up) to 1 (all the way down).
+    //
+    // Every timed move adds `error_per_move` to the uncertainty of the estimate,
+    // reaching an end stop clears it.
+    class Tracker
+    {
+        float m_position;
+        float m_uncertainty;
+        // 1 while rolling down, -1 while rolling up
+        int8_t m_rolling;
+        // direction the slats were last turned for, 0 if it isn't known
+        int8_t m_slats;
+        // whether the move in progress starts by turning the slats
+        bool m_tilt;
+        platform::Clock::time_point m_since;
+        Model m_model;
+
+        float _travelled(platform::Clock::time_point at) const
+        {
+            if (m_rolling == 0 || at <= m_since)
+                return 0;
+            return m_model.travelled(m_rolling, m_tilt, at - m_since);
+        }
+
+        // Direction the slats are turned for at `at`, the move in progress might have turned them.
+        int8_t _slats(platform::Clock::time_point at) const
+        {
+            if (m_rolling == 0 || at - m_since < m_model.delay(false))
+                return m_slats;
+            if (at - m_since >= m_model.delay(m_tilt))
+                return m_rolling;
+            // stopped halfway through turning
+            return 0;
+        }
+
+        float _end() const
+        {
+            return m_rolling > 0 ? 1 : 0;
+        }
+
+        bool _reached_end(platform::Clock::time_point at) const
+        {
+            // it's only certain if the end stop would have been reached from anywhere within the uncertainty
+            const auto distance = std::min(std::abs(_end() - m_position) + m_uncertainty, 1.0f);
+            return m_rolling != 0 && _travelled(at) >= distance;
+        }
+
+    public:
+        // Nothing is known about the shutter until it reaches an end stop.
+        Tracker() : m_position(0), m_uncertainty(1), m_rolling(0), m_slats(0), m_tilt(false), m_model(){};
+
+        Tracker(float position, float uncertainty, int8_t slats = 0)
+            : m_position(position), m_uncertainty(uncertainty), m_rolling(0), m_slats(slats), m_tilt(false), m_model(){};
+
+        // Records that `op` was pressed at `at` for a shutter moving as described by `model`.
+        void press(command::Op op, platform::Clock::time_point at, const Model &model, float error_per_move)
+        {
+            const auto slats = _slats(at);
+            if (_reached_end(at))
+            {
+                m_position = _end();
+                m_uncertainty = 0;
+            }
+            else if (m_rolling != 0)
+            {
+                m_position = position(at);
+                m_uncertainty += error_per_move;
+            }
+
+            switch (op)
+            {
+            case command::Op::Up:
+                m_rolling = -1;
+                break;
+            case command::Op::Down:
+                m_rolling = 1;
+                break;
+            default:
+                m_rolling = 0;
+                break;
+            }
+            m_slats = slats;
+            m_tilt = m_rolling != 0 && m_slats != m_rolling;
+            m_since = at;
+            m_model = model;
+        }
+
+        float position(platform::Clock::time_point at) const
+        {
+            if (m_rolling == 0)
+                return m_position;
+            return std::min(std::max(m_position + m_rolling * _travelled(at), 0.0f), 1.0f);
+        }
+
+        float uncertainty(platform::Clock::time_point at) const
+        {
+            return _reached_end(at) ? 0 : m_uncertainty;
+        }
+
+        // Whether the shutter is still rolling at `at`, as far as it's known.
+        bool rolling(platform::Clock::time_point at) const
+        {
+            return m_rolling != 0 && !_reached_end(at);
+        }
+
+        // 1 while rolling down, -1 while rolling up and 0 otherwise, as far as it's known.
+        int8_t direction(platform::Clock::time_point at) const
+        {
+            return rolling(at) ? m_rolling : 0;
+        }
+
+        // How long after pressing the button towards `target` at `at` stop has to be pressed
+        // for the shutter to come to rest there in a single move. Zero if it's there already or still rolling.
+        chrono_ms time_to(float target, platform::Clock::time_point at, const Model &model) const
+        {
+            const auto distance = target - position(at);
+            if (rolling(at) || distance == 0)
+                return chrono_ms::zero();
+
+            const int8_t direction = distance > 0 ? 1 : -1;
+            return model.press_time(direction, _slats(at) != direction, std::abs(distance));
+        }
+
+        // Where the shutter comes to rest unless another button is pressed.
+        // A rolling shutter keeps going until it reaches the end stop.
+        Tracker resting() const
+        {
+            if (m_rolling == 0)
+                return Tracker(m_position, m_uncertainty, m_slats);
+            return Tracker(_end(), 0, m_rolling);
+        }
+    };
+} // namespace position
+#endif
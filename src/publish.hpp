@@ -0,0 +1,44 @@
+#ifndef publish_ns
+#define publish_ns
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+namespace publish
+{
+    // Remembers the last value published on each of `N` retained topics so only changes are sent.
+    //
+    // It isn't synchronised, it's meant to be used by the loop which does all the publishing.
+    template <typename T, size_t N>
+    class Deltas
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "values are compared byte by byte");
+
+        T m_sent[N];
+        bool m_valid[N];
+
+    public:
+        Deltas() : m_valid(){};
+
+        bool changed(size_t topic, const T &value) const
+        {
+            return !m_valid[topic] || memcmp(&m_sent[topic], &value, sizeof(T)) != 0;
+        }
+
+        // Records that `value` has been published. Values which failed to publish are sent again next time.
+        void sent(size_t topic, const T &value)
+        {
+            m_sent[topic] = value;
+            m_valid[topic] = true;
+        }
+
+        // Makes every topic count as changed, the broker might have lost them.
+        void invalidate()
+        {
+            for (auto &valid : m_valid)
+                valid = false;
+        }
+    };
+} // namespace publish
+#endif
@@ -0,0 +1,220 @@
+#ifndef pulse_ns
+#define pulse_ns
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include <Arduino.h>
+
+#include <platform.hpp>
+#include <trace.hpp>
+
+// Amount of pulse trains which can run at the same time.
+// Every controller only ever presses one button at a time.
+#define PULSE_CHANNELS 4
+
+namespace pulse
+{
+    // `count` pulses of `high` on a pin with `gap` in between.
+    struct Train
+    {
+        uint8_t pin;
+        std::chrono::milliseconds high;
+        std::chrono::milliseconds gap;
+        uint count;
+        // once set, the train ends after the pulse in progress instead of going on with the next one, may be null
+        const std::atomic<bool> *interrupt;
+    };
+
+    // Drives pulse trains from a timer so no task has to sleep while a button is held down.
+    // Trains on different pins run at the same time.
+    template <size_t N>
+    class Engine
+    {
+        struct Channel
+        {
+            bool active;
+            Train train;
+            // pulses which haven't ended yet
+            uint remaining;
+            bool high;
+            platform::Clock::time_point next_edge;
+            void (*done)(void *, uint);
+            void *arg;
+        };
+
+        struct Completion
+        {
+            platform::Mutex lock;
+            platform::ConditionVariable done_cv;
+            bool done;
+            uint remaining;
+        };
+
+        Channel m_channels[N];
+        platform::Mutex m_lock;
+        platform::ConditionVariable m_channel_freed;
+        platform::Timer m_timer;
+        // earliest edge the timer is set for
+        platform::Clock::time_point m_timer_at;
+
+        static void _on_timer(void *arg)
+        {
+            static_cast<Engine *>(arg)->_advance();
+        }
+
+        static void _complete(void *arg, uint remaining)
+        {
+            auto completion = static_cast<Completion *>(arg);
+            std::lock_guard<platform::Mutex> guard(completion->lock);
+            completion->done = true;
+            completion->remaining = remaining;
+            completion->done_cv.notify_all();
+        }
+
+        static void _write(uint8_t pin, bool high)
+        {
+            digitalWrite(pin, high ? HIGH : LOW);
+            trace::g_recorder.edge(pin, high);
+        }
+
+        void _arm()
+        {
+            auto earliest = platform::Clock::time_point::max();
+            for (auto &channel : m_channels)
+                if (channel.active && channel.next_edge < earliest)
+                    earliest = channel.next_edge;
+
+            if (earliest == m_timer_at)
+                return;
+
+            m_timer_at = earliest;
+            if (earliest == platform::Clock::time_point::max())
+                m_timer.stop();
+            else
+                m_timer.start_at(earliest);
+        }
+
+        bool _start(const Train &train, void (*done)(void *, uint), void *arg)
+        {
+            for (auto &channel : m_channels)
+            {
+                if (channel.active)
+                    continue;
+
+                _write(train.pin, true);
+                channel = Channel{true, train, train.count, true, platform::Clock::now() + train.high, done, arg};
+                _arm();
+                return true;
+            }
+            return false;
+        }
+
+        void _advance()
+        {
+            Channel finished[N];
+            size_t finished_count = 0;
+            {
+                std::lock_guard<platform::Mutex> guard(m_lock);
+                const auto now = platform::Clock::now();
+                for (auto &channel : m_channels)
+                {
+                    // edges are timed from the previous one so delays don't add up
+                    while (channel.active)
+                    {
+                        // a gap may be cut short, a pulse never is
+                        if (!channel.high && channel.train.interrupt && *channel.train.interrupt)
+                        {
+                            channel.active = false;
+                            finished[finished_count++] = channel;
+                            break;
+                        }
+                        if (channel.next_edge > now)
+                            break;
+
+                        channel.high = !channel.high;
+                        _write(channel.train.pin, channel.high);
+                        if (channel.high)
+                        {
+                            channel.next_edge += channel.train.high;
+                        }
+                        else if (--channel.remaining > 0)
+                        {
+                            channel.next_edge += channel.train.gap;
+                        }
+                        else
+                        {
+                            channel.active = false;
+                            finished[finished_count++] = channel;
+                        }
+                    }
+                }
+
+                m_timer_at = platform::Clock::time_point::max();
+                _arm();
+                if (finished_count > 0)
+                    m_channel_freed.notify_all();
+            }
+
+            for (size_t i = 0; i < finished_count; i++)
+                if (finished[i].done)
+                    finished[i].done(finished[i].arg, finished[i].remaining);
+        }
+
+    public:
+        Engine() : m_channels(), m_timer(_on_timer, this), m_timer_at(platform::Clock::time_point::max()){};
+
+        void setup()
+        {
+            m_timer.setup();
+        }
+
+        // Starts the train right away and calls `done(arg, remaining)` from the timer once the last pulse has ended.
+        // `remaining` is the number of pulses which were left out because the train was interrupted.
+        // Returns false if every channel is busy.
+        bool start(const Train &train, void (*done)(void *, uint), void *arg)
+        {
+            if (train.count == 0)
+            {
+                if (done)
+                    done(arg, 0);
+                return true;
+            }
+
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            return _start(train, done, arg);
+        }
+
+        // Makes trains notice that their interrupt flag has been set without waiting for the end of their gap.
+        void wake()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            m_timer_at = platform::Clock::now();
+            m_timer.start_at(m_timer_at);
+        }
+
+        // Runs the train and blocks until it's over, waiting for a free channel first if necessary.
+        // Returns the number of pulses sent.
+        uint run(const Train &train)
+        {
+            if (train.count == 0)
+                return 0;
+
+            Completion completion;
+            completion.done = false;
+            completion.remaining = 0;
+            {
+                std::unique_lock<platform::Mutex> lock(m_lock);
+                m_channel_freed.wait(lock, [&] { return _start(train, _complete, &completion); });
+            }
+
+            std::unique_lock<platform::Mutex> lock(completion.lock);
+            completion.done_cv.wait(lock, [&] { return completion.done; });
+            return train.count - completion.remaining;
+        }
+    };
+
+    Engine<PULSE_CHANNELS> g_engine;
+} // namespace pulse
+#endif
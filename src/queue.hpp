@@ -0,0 +1,201 @@
+#ifndef queue_ns
+#define queue_ns
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include <platform.hpp>
+
+namespace queue
+{
+    // How an item that is about to be pushed relates to one that is already queued.
+    enum class Merge
+    {
+        // unrelated, keep looking
+        Skip,
+        // stop looking and queue the item
+        Append,
+        // the item was folded into the queued one
+        Absorb,
+        // the queued item is superseded by the new one, keep looking
+        Drop,
+        // the two items cancel each other out
+        Cancel,
+    };
+
+    // Fixed-capacity FIFO queue which can be shared between tasks.
+    // All storage is allocated up front, pushing never blocks.
+    //
+    // Every item is pushed into a lane. Items in a higher lane are queued ahead of those in lower lanes
+    // and only the items in the highest lane which isn't empty are offered when popping.
+    template <typename T, size_t N>
+    class BoundedQueue
+    {
+        T m_items[N];
+        platform::Context m_contexts[N];
+        // how many times the item was overtaken by a newer one
+        uint8_t m_bypassed[N];
+        uint8_t m_lanes[N];
+        size_t m_head;
+        size_t m_size;
+
+        platform::Mutex m_lock;
+        platform::ConditionVariable m_not_empty;
+
+        size_t _index(size_t position) const
+        {
+            return (m_head + position) % N;
+        }
+
+        void _erase(size_t position)
+        {
+            for (auto i = position; i + 1 < m_size; i++)
+            {
+                m_items[_index(i)] = m_items[_index(i + 1)];
+                m_contexts[_index(i)] = m_contexts[_index(i + 1)];
+                m_bypassed[_index(i)] = m_bypassed[_index(i + 1)];
+                m_lanes[_index(i)] = m_lanes[_index(i + 1)];
+            }
+            m_size--;
+            m_contexts[_index(m_size)] = platform::Context();
+        }
+
+        // Queues the item behind the last one in the same or a higher lane.
+        bool _push(const T &item, uint8_t lane)
+        {
+            if (m_size == N)
+                return false;
+
+            size_t position = 0;
+            while (position < m_size && m_lanes[_index(position)] >= lane)
+                position++;
+
+            for (auto i = m_size; i > position; i--)
+            {
+                m_items[_index(i)] = m_items[_index(i - 1)];
+                m_contexts[_index(i)] = m_contexts[_index(i - 1)];
+                m_bypassed[_index(i)] = m_bypassed[_index(i - 1)];
+                m_lanes[_index(i)] = m_lanes[_index(i - 1)];
+            }
+
+            const auto index = _index(position);
+            m_items[index] = item;
+            m_contexts[index] = platform::Context::current();
+            m_bypassed[index] = 0;
+            m_lanes[index] = lane;
+            m_size++;
+            m_not_empty.notify_one();
+            return true;
+        }
+
+        template <typename F>
+        bool _try_push(const T &item, F merge, uint8_t lane)
+        {
+            auto position = m_size;
+            while (position-- > 0)
+            {
+                const auto result = merge(m_items[_index(position)], item);
+                if (result == Merge::Skip)
+                    continue;
+                if (result == Merge::Append)
+                    break;
+                if (result == Merge::Absorb)
+                {
+                    if (m_lanes[_index(position)] >= lane)
+                        return true;
+
+                    // the queued item takes on the lane of the one folded into it
+                    const T merged = m_items[_index(position)];
+                    _erase(position);
+                    return _push(merged, lane);
+                }
+
+                _erase(position);
+                if (result == Merge::Cancel)
+                    return true;
+            }
+            return _push(item, lane);
+        }
+
+    public:
+        BoundedQueue() : m_head(0), m_size(0){};
+
+        // Pushes multiple items at once so they become visible to consumers together.
+        // Each item is first offered to the queued ones, newest first, and
+        // `merge(T &queued, const T &item)` decides what happens using `Merge`.
+        // Every item goes into the lane given by `lane(const T &)` and `pushed[i]` is set to whether it was accepted.
+        template <typename F, typename L>
+        void try_push(const T *items, size_t count, F merge, L lane, bool *pushed)
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            for (size_t i = 0; i < count; i++)
+                pushed[i] = _try_push(items[i], merge, lane(items[i]));
+        }
+
+        // Pops the item picked by `choose(const T *const *items, size_t count)`.
+        // `choose` receives the items in the highest lane, oldest first, and returns the position of the one to pop.
+        // Items are offered up to and including the first one which has been overtaken `max_bypass` times.
+        // Blocks until an item is popped or `deadline` has passed, returning false in the latter case.
+        // `choose` may also decline to pop any of the items by returning `count`.
+        // The queue is then left alone until a new item arrives or the deadline passes.
+        template <typename F>
+        bool pop_until(platform::Clock::time_point deadline, F choose, uint8_t max_bypass, T &item)
+        {
+            platform::Context().adopt();
+
+            std::unique_lock<platform::Mutex> lock(m_lock);
+            while (true)
+            {
+                if (m_size > 0)
+                {
+                    // nothing may overtake an item which has been overtaken `max_bypass` times
+                    const T *items[N];
+                    size_t count = 0;
+                    while (count < m_size && m_lanes[_index(count)] == m_lanes[m_head])
+                    {
+                        items[count] = &m_items[_index(count)];
+                        if (m_bypassed[_index(count++)] >= max_bypass)
+                            break;
+                    }
+                    const auto position = choose(items, count);
+
+                    if (position < count)
+                    {
+                        for (size_t i = 0; i < position; i++)
+                            m_bypassed[_index(i)]++;
+
+                        item = m_items[_index(position)];
+                        m_contexts[_index(position)].adopt();
+                        _erase(position);
+                        return true;
+                    }
+                }
+
+                if (deadline == platform::Clock::time_point::max())
+                    m_not_empty.wait(lock);
+                else if (m_not_empty.wait_until(lock, deadline) == std::cv_status::timeout)
+                    return false;
+            }
+        }
+
+        // Lane of the item at the head, 0 if the queue is empty.
+        uint8_t top_lane()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            return m_size > 0 ? m_lanes[m_head] : 0;
+        }
+
+        size_t size()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            return m_size;
+        }
+
+        constexpr size_t capacity() const
+        {
+            return N;
+        }
+    };
+} // namespace queue
+#endif
@@ -0,0 +1,65 @@
+#ifndef scheduler_ns
+#define scheduler_ns
+
+#include <algorithm>
+
+#include <arith.hpp>
+#include <shutter.hpp>
+
+namespace scheduler
+{
+    // Finds the shortest way for the selector, starting at `selected`, to pass by every shutter in `targets`.
+    // Returns the position in `targets` of the shutter to visit first.
+    //
+    // Selecting goes around in a ring so the shortest way either goes in one direction
+    // or turns around once. Every turning point is tried.
+    size_t first_stop(ShutterIndex selected, ShutterIndex total, const ShutterIndex *targets, size_t count)
+    {
+        // steps needed to reach the nearest and the farthest target going forwards
+        int nearest = total, farthest = 0;
+        size_t nearest_pos = 0, farthest_pos = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const int steps = arith::sub_modn(targets[i], selected, total);
+            if (steps < nearest)
+            {
+                nearest = steps;
+                nearest_pos = i;
+            }
+            if (steps > farthest)
+            {
+                farthest = steps;
+                farthest_pos = i;
+            }
+        }
+
+        if (nearest == 0)
+            return nearest_pos;
+
+        // only going forwards vs. only going backwards
+        int forwards_cost = farthest;
+        int backwards_cost = total - nearest;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            // go forwards up to this target and cover the ones past it going backwards
+            const int forwards = arith::sub_modn(targets[i], selected, total);
+            int past = total;
+            for (size_t j = 0; j < count; j++)
+            {
+                const int steps = arith::sub_modn(targets[j], selected, total);
+                if (steps > forwards && steps < past)
+                    past = steps;
+            }
+            if (past == total)
+                continue;
+
+            const int backwards = total - past;
+            forwards_cost = std::min(forwards_cost, 2 * forwards + backwards);
+            backwards_cost = std::min(backwards_cost, forwards + 2 * backwards);
+        }
+
+        return forwards_cost <= backwards_cost ? nearest_pos : farthest_pos;
+    }
+} // namespace scheduler
+#endif
@@ -1,15 +1,22 @@
+#ifndef shutter_ns
+#define shutter_ns
+
+#include <algorithm>
+#include <atomic>
 #include <mutex>
-#include <thread>
 
 #include <Arduino.h>
 
 #include <arith.hpp>
+#include <metrics.hpp>
+#include <platform.hpp>
+#include <pulse.hpp>
 
 namespace shutter
 {
 #define ShutterIndex uint8_t
 #define chrono_ms std::chrono::milliseconds
-#define time_now std::chrono::system_clock::now
+#define time_now platform::Clock::now
 
     class ControllerProfile
     {
@@ -27,8 +34,8 @@ namespace shutter
         chrono_ms selection_active_duration_min;
         chrono_ms selection_active_duration_max;
 
-        ControllerProfile(ShutterIndex shutters, chrono_ms select,
-                          chrono_ms active_min, chrono_ms active_max)
+        constexpr ControllerProfile(ShutterIndex shutters, chrono_ms select,
+                                    chrono_ms active_min, chrono_ms active_max)
             : shutters(shutters),
               select_duration(select), select_recovery_duration(select),
               send_duration(2500), send_recovery_duration(750),
@@ -43,6 +50,11 @@ namespace shutter
     public:
         ControllerButton(uint8_t pin) : m_pin(pin){};
 
+        uint8_t pin() const
+        {
+            return m_pin;
+        }
+
         void setup() const
         {
             pinMode(m_pin, OUTPUT);
@@ -50,22 +62,76 @@ namespace shutter
 
         void press(chrono_ms duration) const
         {
-            digitalWrite(m_pin, HIGH);
-            std::this_thread::sleep_for(duration);
-            digitalWrite(m_pin, LOW);
+            press_repeat(duration, 1, chrono_ms::zero());
         }
 
-        void press_repeat(chrono_ms duration, uint count, chrono_ms pause) const
+        // Once `interrupt` is set the pauses are cut short and the remaining presses left out.
+        // Returns the number of presses made, never less than one unless `count` is 0.
+        uint press_repeat(chrono_ms duration, uint count, chrono_ms pause, const std::atomic<bool> *interrupt = nullptr) const
         {
-            if (count == 0)
-                return;
+            return pulse::g_engine.run(pulse::Train{m_pin, duration, pause, count, interrupt});
+        }
+    };
 
-            press(duration);
-            for (auto i = 1; i < count; i++)
-            {
-                std::this_thread::sleep_for(pause);
-                press(duration);
-            }
+    // Optional input wired to the LED of the remote which is lit while the selection is active.
+    class SelectionLed
+    {
+        uint8_t m_pin;
+
+    public:
+        static const uint8_t NO_PIN = 0xFF;
+
+        SelectionLed(uint8_t pin = NO_PIN) : m_pin(pin){};
+
+        bool connected() const
+        {
+            return m_pin != NO_PIN;
+        }
+
+        uint8_t pin() const
+        {
+            return m_pin;
+        }
+
+        void setup() const
+        {
+            if (connected())
+                pinMode(m_pin, INPUT);
+        }
+
+        bool lit() const
+        {
+            return digitalRead(m_pin) == HIGH;
+        }
+    };
+
+    // Profile and pins of a controller, known at compile time so the configuration can be checked.
+    struct ControllerConfig
+    {
+        // pins a controller can use, the buttons and the LED
+        static const size_t PINS = 6;
+
+        ControllerProfile profile;
+        uint8_t up, stop, down, previous, next;
+        uint8_t selection_led;
+
+        constexpr ControllerConfig(ControllerProfile profile,
+                                   uint8_t up, uint8_t stop, uint8_t down,
+                                   uint8_t previous, uint8_t next,
+                                   uint8_t selection_led = SelectionLed::NO_PIN)
+            : profile(profile),
+              up(up), stop(stop), down(down),
+              previous(previous), next(next),
+              selection_led(selection_led){};
+
+        constexpr uint8_t pin(size_t i) const
+        {
+            return i == 0   ? up
+                   : i == 1 ? stop
+                   : i == 2 ? down
+                   : i == 3 ? previous
+                   : i == 4 ? next
+                            : selection_led;
         }
     };
 
@@ -79,40 +145,104 @@ namespace shutter
     {
         ControllerProfile m_profile;
         ControllerButton m_up, m_stop, m_down, m_previous, m_next;
+        SelectionLed m_selection_led;
 
-        std::mutex m_controller_lock;
-        ShutterIndex m_selected_shutter;
+        platform::Mutex m_controller_lock;
+        // changed by the worker while it holds the lock, but read by others without it
+        std::atomic<ShutterIndex> m_selected_shutter;
         unsigned long m_last_selection_active_at;
 
+        // an urgent command is waiting for the controller
+        std::atomic<bool> m_interrupt;
+        // whether the command being executed may be cut short by `m_interrupt`
+        bool m_interruptible;
+
+        // With the LED a press which didn't get through to the remote can be noticed,
+        // the selection then stays where it was.
+        bool _press_registered()
+        {
+            if (!m_selection_led.connected() || m_selection_led.lit())
+                return true;
+
+            Serial.println("selection press wasn't registered, correcting selection");
+            metrics::g_registry.count(metrics::Counter::SelectionCorrected);
+            return false;
+        }
+
         void _select_previous_shutter()
         {
             m_previous.press(m_profile.select_duration);
-            m_selected_shutter = arith::sub_modn(m_selected_shutter, (ShutterIndex)1, m_profile.shutters);
+            if (_press_registered())
+                m_selected_shutter = arith::sub_modn(m_selected_shutter.load(), (ShutterIndex)1, m_profile.shutters);
             m_last_selection_active_at = millis();
         }
 
         void _select_next_shutter()
         {
             m_next.press(m_profile.select_duration);
-            m_selected_shutter = arith::add_modn(m_selected_shutter, (ShutterIndex)1, m_profile.shutters);
+            if (_press_registered())
+                m_selected_shutter = arith::add_modn(m_selected_shutter.load(), (ShutterIndex)1, m_profile.shutters);
             m_last_selection_active_at = millis();
         }
 
-        void _ensure_selection_active()
+        chrono_ms _selection_elapsed() const
         {
-            const chrono_ms elapsed(millis() - m_last_selection_active_at);
-            if (elapsed < m_profile.selection_active_duration_min)
-                // still active!
-                return;
+            return chrono_ms(millis() - m_last_selection_active_at);
+        }
 
-            if (elapsed < m_profile.selection_active_duration_max)
-                // not certain whether still active, delay until we're sure it's off.
-                std::this_thread::sleep_for(m_profile.selection_active_duration_max - elapsed);
+        ShutterIndex _selection_steps(ShutterIndex shutter) const
+        {
+            const auto steps = arith::sub_modn(shutter, m_selected_shutter.load(), m_profile.shutters);
+            return steps > m_profile.shutters / 2 ? m_profile.shutters - steps : steps;
+        }
+
+        // Time `_select_shutter` takes if the selection was last active `elapsed` ago.
+        chrono_ms _selection_time(ShutterIndex shutter, chrono_ms elapsed) const
+        {
+            const auto steps = _selection_steps(shutter);
+            if (steps == 0)
+                return chrono_ms::zero();
+
+            const auto step = m_profile.select_duration + m_profile.select_recovery_duration;
+            auto time = m_profile.select_recovery_duration + steps * step;
+
+            elapsed += m_profile.select_recovery_duration;
+            if (elapsed >= m_profile.selection_active_duration_min)
+            {
+                // the LED tells right away, otherwise it's only certain once the maximum has passed
+                if (!m_selection_led.connected() && elapsed < m_profile.selection_active_duration_max)
+                    time += m_profile.selection_active_duration_max - elapsed;
+                time += step;
+            }
+            return time;
+        }
+
+        void _ensure_selection_active()
+        {
+            if (m_selection_led.connected())
+            {
+                if (m_selection_led.lit())
+                    return;
+            }
+            else
+            {
+                const auto elapsed = _selection_elapsed();
+                if (elapsed < m_profile.selection_active_duration_min)
+                    // still active!
+                    return;
+
+                if (elapsed < m_profile.selection_active_duration_max)
+                {
+                    // not certain whether still active, delay until we're sure it's off.
+                    metrics::Timed timed(metrics::Phase::SelectionGuard);
+                    platform::sleep_for(m_profile.selection_active_duration_max - elapsed);
+                }
+            }
 
             // this doesn't change the selection, it only makes it active.
             m_next.press(m_profile.select_duration);
             m_last_selection_active_at = millis();
-            std::this_thread::sleep_for(m_profile.select_recovery_duration);
+            platform::sleep_for(m_profile.select_recovery_duration);
         }
 
         void _select_shutter(ShutterIndex shutter)
@@ -121,7 +251,7 @@ namespace shutter
             const ShutterIndex HALFWAY_POINT = TOTAL_SHUTTERS / 2;
 
             auto forwards = true;
-            auto steps = arith::sub_modn(shutter, m_selected_shutter, TOTAL_SHUTTERS);
+            auto steps = arith::sub_modn(shutter, m_selected_shutter.load(), TOTAL_SHUTTERS);
             if (steps == 0)
                 return;
 
@@ -131,76 +261,97 @@ namespace shutter
                 steps = TOTAL_SHUTTERS - steps;
             }
 
-            std::this_thread::sleep_for(m_profile.select_recovery_duration);
+            metrics::Timed timed(metrics::Phase::Selecting);
+            platform::sleep_for(m_profile.select_recovery_duration);
             _ensure_selection_active();
 
-            for (auto i = 0; i < steps; i++)
+            // presses which weren't registered are repeated, but not forever
+            for (auto attempts = 2 * steps; m_selected_shutter != shutter && attempts > 0; attempts--)
             {
                 if (forwards)
                     _select_next_shutter();
                 else
                     _select_previous_shutter();
 
-                std::this_thread::sleep_for(m_profile.select_recovery_duration);
+                platform::sleep_for(m_profile.select_recovery_duration);
             }
         }
 
-        void _press_up(ShutterIndex shutter, uint count)
+        // Sleeps until the shutter has to be selected for a press to happen at `at`.
+        void _await_selection(ShutterIndex shutter, platform::Clock::time_point at)
         {
-            _select_shutter(shutter);
-            m_up.press_repeat(m_profile.send_duration, count, m_profile.send_recovery_duration);
-            m_last_selection_active_at = millis();
+            // selecting takes the least time if the selection is still active once it has to start
+            const auto active_time = _selection_time(shutter, chrono_ms::zero());
+            const auto active_start = at - active_time;
+            const auto elapsed_then = _selection_elapsed() + std::chrono::duration_cast<chrono_ms>(active_start - time_now());
+            if (_selection_time(shutter, elapsed_then) == active_time)
+            {
+                platform::sleep_until(active_start);
+                return;
+            }
+
+            // otherwise it takes longest right after it might have become inactive, starting that early is never late
+            platform::sleep_until(at - selection_lead(shutter));
+        }
+
+        // Selection presses are never interrupted, the selection would be lost track of.
+        void _send(const ControllerButton &button, uint count)
+        {
+            const auto sent = button.press_repeat(m_profile.send_duration, count, m_profile.send_recovery_duration,
+                                                  m_interruptible ? &m_interrupt : nullptr);
+            if (sent < count)
+                metrics::g_registry.count(metrics::Counter::Interrupted);
         }
 
-        void _press_stop(ShutterIndex shutter, uint count)
+        platform::Clock::time_point _press_up(ShutterIndex shutter, uint count, platform::Clock::time_point at = platform::Clock::time_point())
         {
             _select_shutter(shutter);
-            m_stop.press_repeat(m_profile.send_duration, count, m_profile.send_recovery_duration);
+            platform::sleep_until(at);
+            const auto pressed_at = time_now();
+            _send(m_up, count);
+            metrics::g_registry.record(metrics::Phase::Pressing, time_now() - pressed_at);
             m_last_selection_active_at = millis();
+            return pressed_at;
         }
 
-        void _press_down(ShutterIndex shutter, uint count)
+        platform::Clock::time_point _press_stop(ShutterIndex shutter, uint count, platform::Clock::time_point at = platform::Clock::time_point())
         {
             _select_shutter(shutter);
-            m_down.press_repeat(m_profile.send_duration, count, m_profile.send_recovery_duration);
+            platform::sleep_until(at);
+            const auto pressed_at = time_now();
+            _send(m_stop, count);
+            metrics::g_registry.record(metrics::Phase::Pressing, time_now() - pressed_at);
             m_last_selection_active_at = millis();
+            return pressed_at;
         }
 
-        template <typename T>
-        void _sleep_until(T s)
+        platform::Clock::time_point _press_down(ShutterIndex shutter, uint count, platform::Clock::time_point at = platform::Clock::time_point())
         {
-            const chrono_ms MIN_SLEEP_FOR_UNLOCK(15000);
-            const chrono_ms EARLY_WAKEUP_FOR_LOCK(4000);
-
-            auto timeout = s - time_now();
-            if (timeout < MIN_SLEEP_FOR_UNLOCK)
-            {
-                std::this_thread::sleep_until(s);
-                return;
-            }
-
-            Serial.println("[smart lock] unlocking");
-            m_controller_lock.unlock();
-            std::this_thread::sleep_for(timeout - EARLY_WAKEUP_FOR_LOCK);
-            Serial.println("[smart lock] reacquiring lock");
-            m_controller_lock.lock();
-            std::this_thread::sleep_until(s);
+            _select_shutter(shutter);
+            platform::sleep_until(at);
+            const auto pressed_at = time_now();
+            _send(m_down, count);
+            metrics::g_registry.record(metrics::Phase::Pressing, time_now() - pressed_at);
+            m_last_selection_active_at = millis();
+            return pressed_at;
         }
 
     public:
         Controller(ControllerProfile profile,
                    ControllerButton up, ControllerButton stop, ControllerButton down,
-                   ControllerButton previous, ControllerButton next)
+                   ControllerButton previous, ControllerButton next,
+                   SelectionLed selection_led = SelectionLed())
             : m_profile(profile),
               m_up(up), m_stop(stop), m_down(down),
-              m_previous(previous), m_next(next){};
+              m_previous(previous), m_next(next),
+              m_selection_led(selection_led),
+              m_selected_shutter(0), m_interrupt(false), m_interruptible(false){};
 
-        Controller(ControllerProfile profile,
-                   uint8_t up, uint8_t stop, uint8_t down,
-                   uint8_t previous, uint8_t next)
-            : Controller(profile,
-                         ControllerButton(up), ControllerButton(stop), ControllerButton(down),
-                         ControllerButton(previous), ControllerButton(next)){};
+        Controller(const ControllerConfig &config)
+            : Controller(config.profile,
+                         ControllerButton(config.up), ControllerButton(config.stop), ControllerButton(config.down),
+                         ControllerButton(config.previous), ControllerButton(config.next),
+                         SelectionLed(config.selection_led)){};
 
         void setup() const
         {
@@ -208,6 +359,10 @@ namespace shutter
             {
                 btn.setup();
             }
+
+            m_selection_led.setup();
+            if (m_selection_led.connected())
+                platform::wire_selection_led(m_selection_led.pin(), {m_up.pin(), m_stop.pin(), m_down.pin(), m_previous.pin(), m_next.pin()});
         }
 
         ShutterIndex get_selected_shutter() const
@@ -225,73 +380,79 @@ namespace shutter
             return m_profile.shutters;
         }
 
-        void roll_up(ShutterIndex shutter)
+        // Asks the command in progress to leave out its remaining repeats, if it may.
+        void interrupt()
         {
-            std::lock_guard<std::mutex> guard(m_controller_lock);
-            _press_up(shutter, m_profile.send_count);
+            m_interrupt = true;
+            pulse::g_engine.wake();
         }
 
-        void roll_up(ShutterIndex shutter, chrono_ms time)
+        void clear_interrupt()
         {
-            std::lock_guard<std::mutex> guard(m_controller_lock);
-            auto sleep_until = time_now() + time;
-            _press_up(shutter, m_profile.send_count);
-            _sleep_until(sleep_until);
-            _press_stop(shutter, m_profile.send_count);
+            m_interrupt = false;
         }
 
-        void roll_stop(ShutterIndex shutter)
+        // Only the worker of the controller calls this, before executing a command.
+        void set_interruptible(bool interruptible)
         {
-            std::lock_guard<std::mutex> guard(m_controller_lock);
-            _press_stop(shutter, m_profile.send_count);
+            m_interruptible = interruptible;
         }
 
-        void roll_down(ShutterIndex shutter)
+        // Longest it may take from now on to select the shutter.
+        chrono_ms selection_lead(ShutterIndex shutter) const
         {
-            std::lock_guard<std::mutex> guard(m_controller_lock);
-            _press_down(shutter, m_profile.send_count);
+            // the selection might become inactive in the meantime
+            return _selection_time(shutter, std::max(_selection_elapsed(), m_profile.selection_active_duration_min));
         }
 
-        void roll_down(ShutterIndex shutter, chrono_ms time)
+        // Longest it may take from now on to send a command to the shutter.
+        chrono_ms command_duration(ShutterIndex shutter) const
         {
-            std::lock_guard<std::mutex> guard(m_controller_lock);
-            auto sleep_until = time_now() + time;
-            _press_down(shutter, m_profile.send_count);
-            _sleep_until(sleep_until);
-            _press_stop(shutter, m_profile.send_count);
+            const auto count = m_profile.send_count;
+            return selection_lead(shutter) + count * m_profile.send_duration +
+                   (count > 0 ? count - 1 : 0) * m_profile.send_recovery_duration;
         }
 
-        void roll_from_top(ShutterProfile shutter, chrono_ms time)
+        void roll_up(ShutterIndex shutter)
         {
-            roll_up(shutter.index);
-            std::this_thread::sleep_for(shutter.total_time);
-            roll_down(shutter.index, time);
+            const auto guard = metrics::lock(m_controller_lock);
+            _press_up(shutter, m_profile.send_count);
         }
 
-        void roll_from_bottom(ShutterProfile shutter, chrono_ms time)
+        // Selects the shutter in advance so the press happens at `at`.
+        // Returns when the button was pressed, which is later if the controller was busy.
+        platform::Clock::time_point roll_up_at(ShutterIndex shutter, platform::Clock::time_point at)
         {
-            roll_down(shutter.index);
-            std::this_thread::sleep_for(shutter.total_time);
-            roll_up(shutter.index, time);
+            const auto guard = metrics::lock(m_controller_lock);
+            _await_selection(shutter, at);
+            return _press_up(shutter, m_profile.send_count, at);
         }
 
-        void roll_to(ShutterProfile shutter, double percentage)
+        void roll_stop(ShutterIndex shutter)
         {
-            if (percentage < 0.0 || percentage > 1.0)
-                return;
+            const auto guard = metrics::lock(m_controller_lock);
+            _press_stop(shutter, m_profile.send_count);
+        }
 
-            auto from_top = true;
-            if (percentage > 0.5)
-            {
-                from_top = false;
-                percentage = 1.0 - percentage;
-            }
+        platform::Clock::time_point roll_stop_at(ShutterIndex shutter, platform::Clock::time_point at)
+        {
+            const auto guard = metrics::lock(m_controller_lock);
+            _await_selection(shutter, at);
+            return _press_stop(shutter, m_profile.send_count, at);
+        }
 
-            auto time = std::chrono::duration_cast<chrono_ms>(percentage * shutter.total_time);
-            if (from_top)
-                roll_from_top(shutter, time);
-            else
-                roll_from_bottom(shutter, time);
+        void roll_down(ShutterIndex shutter)
+        {
+            const auto guard = metrics::lock(m_controller_lock);
+            _press_down(shutter, m_profile.send_count);
+        }
+
+        platform::Clock::time_point roll_down_at(ShutterIndex shutter, platform::Clock::time_point at)
+        {
+            const auto guard = metrics::lock(m_controller_lock);
+            _await_selection(shutter, at);
+            return _press_down(shutter, m_profile.send_count, at);
         }
     };
 } // namespace shutter
+#endif
@@ -0,0 +1,79 @@
+#ifndef snapshot_ns
+#define snapshot_ns
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+
+#include <platform.hpp>
+
+namespace snapshot
+{
+    // Value which readers copy without ever waiting for a writer, they retry if a write got in the way.
+    // Writers are serialised by a mutex, which readers don't touch.
+    //
+    // The value is kept in atomic words so a read which overlaps a write is only wasted, never undefined.
+    template <typename T>
+    class SeqLock
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "the value is copied word by word");
+
+        static const size_t WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+        // odd while a write is in progress
+        std::atomic<uint32_t> m_sequence;
+        std::atomic<uint32_t> m_words[WORDS];
+        platform::Mutex m_write_lock;
+
+        void _load(T &value) const
+        {
+            uint32_t words[WORDS];
+            for (size_t i = 0; i < WORDS; i++)
+                words[i] = m_words[i].load(std::memory_order_relaxed);
+            memcpy(&value, words, sizeof(T));
+        }
+
+    public:
+        SeqLock() : m_sequence(0), m_words(){};
+
+        // Copies the latest value into `value` and returns its version, which goes up with every update.
+        uint32_t read(T &value) const
+        {
+            while (true)
+            {
+                const auto before = m_sequence.load(std::memory_order_acquire);
+                if (before & 1)
+                    continue;
+
+                _load(value);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (m_sequence.load(std::memory_order_relaxed) == before)
+                    return before / 2;
+            }
+        }
+
+        // Calls `modify(T &)` on a copy of the latest value and publishes the result.
+        template <typename F>
+        void update(F modify)
+        {
+            std::lock_guard<platform::Mutex> guard(m_write_lock);
+            T value;
+            _load(value);
+            modify(value);
+
+            uint32_t words[WORDS] = {};
+            memcpy(words, &value, sizeof(T));
+
+            const auto sequence = m_sequence.load(std::memory_order_relaxed);
+            m_sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < WORDS; i++)
+                m_words[i].store(words[i], std::memory_order_relaxed);
+            m_sequence.store(sequence + 2, std::memory_order_release);
+        }
+    };
+} // namespace snapshot
+#endif
@@ -1,7 +1,6 @@
-#include <thread>
-
 #include <Arduino.h>
 
+#include <platform.hpp>
 #include <shutter.hpp>
 
 shutter::Controller *get_controller(ShutterIndex *shutter);
@@ -41,6 +40,6 @@ void test_select_right()
 void test()
 {
     delay(5000);
-    std::thread(test_select_left).detach();
-    std::thread(test_select_right).detach();
+    platform::spawn(test_select_left);
+    platform::spawn(test_select_right);
 }
\ No newline at end of file
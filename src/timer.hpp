@@ -0,0 +1,94 @@
+#ifndef timer_ns
+#define timer_ns
+
+#include <cstddef>
+
+#include <platform.hpp>
+
+namespace timer
+{
+    // Fixed-capacity set of items which become due at a point in time.
+    // There are only ever a handful of timers so the slots are simply scanned.
+    //
+    // It isn't synchronised, only the task owning it may use it.
+    template <typename T, size_t N>
+    class TimerSet
+    {
+    public:
+        struct Timer
+        {
+            platform::Clock::time_point at;
+            T item;
+            // context of the task which scheduled the timer
+            platform::Context context;
+        };
+
+    private:
+        Timer m_timers[N];
+        bool m_used[N];
+
+        void _release(Timer *timer)
+        {
+            timer->context = platform::Context();
+            m_used[timer - m_timers] = false;
+        }
+
+    public:
+        TimerSet() : m_used(){};
+
+        // Returns false if every slot is taken.
+        bool schedule(platform::Clock::time_point at, const T &item)
+        {
+            for (size_t i = 0; i < N; i++)
+            {
+                if (m_used[i])
+                    continue;
+
+                m_timers[i].at = at;
+                m_timers[i].item = item;
+                m_timers[i].context = platform::Context::current();
+                m_used[i] = true;
+                return true;
+            }
+            return false;
+        }
+
+        // Returns the first timer for which `pred(const Timer &)` holds or null if there's none.
+        template <typename F>
+        Timer *find(F pred)
+        {
+            for (size_t i = 0; i < N; i++)
+                if (m_used[i] && pred(m_timers[i]))
+                    return &m_timers[i];
+            return nullptr;
+        }
+
+        // Returns the timer with the smallest `key(const Timer &)` or null if there are no timers.
+        template <typename F>
+        Timer *earliest(F key)
+        {
+            Timer *earliest = nullptr;
+            for (size_t i = 0; i < N; i++)
+            {
+                if (m_used[i] && (!earliest || key(m_timers[i]) < key(*earliest)))
+                    earliest = &m_timers[i];
+            }
+            return earliest;
+        }
+
+        // Removes the timer and makes the calling task carry its context.
+        T take(Timer *timer)
+        {
+            timer->context.adopt();
+            const T item = timer->item;
+            _release(timer);
+            return item;
+        }
+
+        void cancel(Timer *timer)
+        {
+            _release(timer);
+        }
+    };
+} // namespace timer
+#endif
@@ -0,0 +1,291 @@
+#ifndef trace_ns
+#define trace_ns
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include <Arduino.h>
+
+#include <platform.hpp>
+
+// Bytes of records kept until they're streamed. Records which don't fit are counted as lost.
+#define TRACE_BUFFER_SIZE 2048
+// Record bytes per chunk, small enough to be published with the default MQTT packet size.
+#define TRACE_CHUNK_SIZE 192
+
+// Compact binary trace of the commands received and the button edges they caused
+// so real workloads can be replayed by the simulator.
+//
+// The trace is streamed in chunks which can simply be concatenated:
+//   magic (1 byte) | version (1) | sequence (2) | first (2) | length (2) | `length` bytes of records
+// Records may continue in the next chunk, `first` is the offset of the first record starting in this one
+// (or `NO_RECORD`) so a reader can pick up again after a chunk was lost.
+//
+// Every record starts with its kind (1) and the time in milliseconds since the board started (4):
+//   Command: topic length (1) | topic | payload length (2) | payload
+//   Rise, Fall: pin (1)
+//   Lost: number of records which didn't fit into the buffer (2)
+// Numbers are little endian.
+namespace trace
+{
+    const uint8_t MAGIC = 0xEC;
+    const uint8_t VERSION = 1;
+    const uint16_t NO_RECORD = 0xFFFF;
+
+    const size_t CHUNK_HEADER_SIZE = 8;
+    const size_t RECORD_HEADER_SIZE = 5;
+    const size_t MAX_CHUNK_SIZE = CHUNK_HEADER_SIZE + TRACE_CHUNK_SIZE;
+
+    enum class Kind : uint8_t
+    {
+        Command = 1,
+        Rise,
+        Fall,
+        Lost,
+    };
+
+    inline void put16(uint8_t *at, uint16_t value)
+    {
+        at[0] = value;
+        at[1] = value >> 8;
+    }
+
+    inline void put32(uint8_t *at, uint32_t value)
+    {
+        put16(at, value);
+        put16(at + 2, value >> 16);
+    }
+
+    inline uint16_t get16(const uint8_t *at)
+    {
+        return at[0] | at[1] << 8;
+    }
+
+    inline uint32_t get32(const uint8_t *at)
+    {
+        return get16(at) | (uint32_t)get16(at + 2) << 16;
+    }
+
+    // Size of the record starting at `record` if `available` bytes of it are enough to tell, otherwise 0.
+    inline size_t record_size(const uint8_t *record, size_t available)
+    {
+        if (available < RECORD_HEADER_SIZE + 1)
+            return 0;
+
+        switch ((Kind)record[0])
+        {
+        case Kind::Command:
+        {
+            const size_t topic_end = RECORD_HEADER_SIZE + 1 + record[RECORD_HEADER_SIZE];
+            return available < topic_end + 2 ? 0 : topic_end + 2 + get16(record + topic_end);
+        }
+        case Kind::Lost:
+            return RECORD_HEADER_SIZE + 2;
+        default:
+            return RECORD_HEADER_SIZE + 1;
+        }
+    }
+
+    // Collects records in a buffer until they're taken out in chunks.
+    // Recording is safe from any task and the pulse timer, it's a single atomic load while disabled.
+    template <size_t N>
+    class Recorder
+    {
+        std::atomic<bool> m_enabled;
+        platform::Mutex m_lock;
+        uint8_t m_buffer[N];
+        size_t m_size;
+        // bytes at the start of the buffer which belong to a record whose start went out with an earlier chunk
+        size_t m_continued;
+        uint16_t m_sequence;
+        uint16_t m_lost;
+
+        // Appends a record of `size` bytes whose header is filled in, the caller writes the rest.
+        uint8_t *_append(Kind kind, size_t size)
+        {
+            const auto lost_size = m_lost > 0 ? RECORD_HEADER_SIZE + 2 : 0;
+            if (m_size + lost_size + size > N)
+            {
+                if (m_lost < UINT16_MAX)
+                    m_lost++;
+                return nullptr;
+            }
+
+            const uint32_t now = millis();
+            if (m_lost > 0)
+            {
+                m_buffer[m_size] = (uint8_t)Kind::Lost;
+                put32(&m_buffer[m_size + 1], now);
+                put16(&m_buffer[m_size + RECORD_HEADER_SIZE], m_lost);
+                m_size += lost_size;
+                m_lost = 0;
+            }
+
+            auto record = &m_buffer[m_size];
+            record[0] = (uint8_t)kind;
+            put32(record + 1, now);
+            m_size += size;
+            return record;
+        }
+
+    public:
+        Recorder() : m_enabled(false), m_size(0), m_continued(0), m_sequence(0), m_lost(0){};
+
+        void enable()
+        {
+            m_enabled = true;
+        }
+
+        bool enabled() const
+        {
+            return m_enabled;
+        }
+
+        void command(const char *topic, const uint8_t *payload, size_t length)
+        {
+            if (!m_enabled)
+                return;
+
+            const auto topic_length = std::min(strlen(topic), (size_t)UINT8_MAX);
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            auto record = _append(Kind::Command, RECORD_HEADER_SIZE + 1 + topic_length + 2 + length);
+            if (!record)
+                return;
+
+            record += RECORD_HEADER_SIZE;
+            *record++ = topic_length;
+            memcpy(record, topic, topic_length);
+            record += topic_length;
+            put16(record, length);
+            memcpy(record + 2, payload, length);
+        }
+
+        void edge(uint8_t pin, bool level)
+        {
+            if (!m_enabled)
+                return;
+
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            auto record = _append(level ? Kind::Rise : Kind::Fall, RECORD_HEADER_SIZE + 1);
+            if (record)
+                record[RECORD_HEADER_SIZE] = pin;
+        }
+
+        // Number of record bytes waiting to be taken.
+        size_t pending()
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            return m_size;
+        }
+
+        // Moves up to `TRACE_CHUNK_SIZE` bytes of records into `chunk` which must hold `MAX_CHUNK_SIZE` bytes.
+        // Returns the size of the chunk, 0 if there was nothing to take.
+        size_t take_chunk(uint8_t *chunk)
+        {
+            std::lock_guard<platform::Mutex> guard(m_lock);
+            if (m_size == 0)
+                return 0;
+
+            const auto length = std::min(m_size, (size_t)TRACE_CHUNK_SIZE);
+            auto next = m_continued;
+            while (next < length)
+                next += record_size(&m_buffer[next], m_size - next);
+
+            chunk[0] = MAGIC;
+            chunk[1] = VERSION;
+            put16(chunk + 2, m_sequence++);
+            put16(chunk + 4, m_continued < length ? m_continued : NO_RECORD);
+            put16(chunk + 6, length);
+            memcpy(chunk + CHUNK_HEADER_SIZE, m_buffer, length);
+
+            memmove(m_buffer, &m_buffer[length], m_size - length);
+            m_size -= length;
+            m_continued = next - length;
+            return CHUNK_HEADER_SIZE + length;
+        }
+    };
+
+    Recorder<TRACE_BUFFER_SIZE> g_recorder;
+
+    // Reassembles the records of a trace, concatenated chunks in `data`, and hands them to `handler`:
+    //   handler.command(ms, topic, topic_length, payload, length)
+    //   handler.edge(ms, pin, level)
+    //   handler.lost(records) for records which didn't fit into the buffer or were in a chunk that's missing (0 if unknown)
+    // The records are reassembled in place so `data` is overwritten.
+    // Returns false if the data isn't a trace.
+    template <typename H>
+    bool read(uint8_t *data, size_t size, H &handler)
+    {
+        // reassembled records are written to the front of the buffer which is never ahead of the chunk being read
+        size_t written = 0;
+        size_t parsed = 0;
+        bool synced = false;
+        uint16_t expected = 0;
+
+        size_t offset = 0;
+        while (offset < size)
+        {
+            if (size - offset < CHUNK_HEADER_SIZE || data[offset] != MAGIC || data[offset + 1] != VERSION)
+                return false;
+
+            const auto chunk = data + offset;
+            const auto sequence = get16(chunk + 2);
+            const auto first = get16(chunk + 4);
+            const size_t length = get16(chunk + 6);
+            offset += CHUNK_HEADER_SIZE;
+            // a record can't start past the end of its chunk
+            if (size - offset < length || (first != NO_RECORD && first > length))
+                return false;
+
+            size_t skip = 0;
+            if (!synced || sequence != expected)
+            {
+                // the end of the record in progress is gone
+                if (synced)
+                    handler.lost(0);
+                written = parsed;
+                synced = first != NO_RECORD;
+                skip = synced ? first : length;
+            }
+            expected = sequence + 1;
+
+            memmove(data + written, data + offset + skip, length - skip);
+            written += length - skip;
+            offset += length;
+
+            size_t record_length;
+            while ((record_length = record_size(data + parsed, written - parsed)) != 0 && parsed + record_length <= written)
+            {
+                const auto record = data + parsed;
+                const auto ms = get32(record + 1);
+                switch ((Kind)record[0])
+                {
+                case Kind::Command:
+                {
+                    const auto topic_length = record[RECORD_HEADER_SIZE];
+                    const auto topic = (const char *)record + RECORD_HEADER_SIZE + 1;
+                    const auto payload = record + RECORD_HEADER_SIZE + 1 + topic_length;
+                    handler.command(ms, topic, topic_length, payload + 2, get16(payload));
+                    break;
+                }
+                case Kind::Rise:
+                case Kind::Fall:
+                    handler.edge(ms, record[RECORD_HEADER_SIZE], (Kind)record[0] == Kind::Rise);
+                    break;
+                case Kind::Lost:
+                    handler.lost(get16(record + RECORD_HEADER_SIZE));
+                    break;
+                default:
+                    return false;
+                }
+                parsed += record_length;
+            }
+        }
+        return true;
+    }
+} // namespace trace
+#endif
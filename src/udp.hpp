@@ -0,0 +1,103 @@
+#ifndef udp_ns
+#define udp_ns
+
+#include <cstddef>
+#include <cstdint>
+
+// Commands sent straight to the board over UDP, i.e. by wall switches on the local network,
+// which skips the round trip through the broker.
+//
+// A datagram holds a single command document like the ones on "ewfs/command", in JSON or MessagePack,
+// plus a sequence number "seq" which the sender counts up. It's answered in the same format with
+//   {"seq": 17, "queued": 2, "rejected": 0, "expired": 0}
+// which are the number of shutters the command was queued for, couldn't be queued for and was dropped for because it expired.
+// "invalid": true is added if the command couldn't be decoded or addresses shutters which don't exist. Datagrams without a sequence number aren't answered.
+//
+// A sender which doesn't get an answer sends the same datagram again.
+// A repeat of a sender's last datagram gets the same answer again without executing the command twice.
+namespace udp
+{
+    struct Ack
+    {
+        uint32_t seq;
+        uint16_t queued;
+        uint16_t rejected;
+        uint16_t expired;
+        bool invalid;
+    };
+
+    struct Sender
+    {
+        uint32_t address;
+        uint16_t port;
+    };
+
+    // MessagePack documents start with a map marker, JSON ones with '{' which is a small integer in MessagePack.
+    inline bool is_msgpack(const uint8_t *payload, size_t length)
+    {
+        return length > 0 && ((payload[0] & 0xF0) == 0x80 || payload[0] == 0xDE || payload[0] == 0xDF);
+    }
+
+    // Remembers the last answer sent to each of the `N` senders heard from most recently.
+    template <size_t N>
+    class Senders
+    {
+        struct Entry
+        {
+            Sender sender;
+            Ack ack;
+            // value of `m_clock` when the sender was last heard from
+            uint32_t heard;
+        };
+
+        Entry m_entries[N];
+        size_t m_count;
+        uint32_t m_clock;
+
+        Entry *_find(const Sender &sender)
+        {
+            for (size_t i = 0; i < m_count; i++)
+                if (m_entries[i].sender.address == sender.address && m_entries[i].sender.port == sender.port)
+                    return &m_entries[i];
+            return nullptr;
+        }
+
+    public:
+        Senders() : m_entries(), m_count(0), m_clock(0){};
+
+        // Whether a datagram with the sequence number in `ack` repeats the sender's last one.
+        // If it does `ack` is set to the answer it got.
+        bool repeated(const Sender &sender, Ack &ack)
+        {
+            auto entry = _find(sender);
+            if (!entry || entry->ack.seq != ack.seq)
+                return false;
+
+            entry->heard = ++m_clock;
+            ack = entry->ack;
+            return true;
+        }
+
+        // Replaces the last answer sent to the sender. A new sender takes the place of the one heard from least recently if there's no room.
+        void remember(const Sender &sender, const Ack &ack)
+        {
+            auto entry = _find(sender);
+            if (!entry)
+            {
+                if (m_count < N)
+                    entry = &m_entries[m_count++];
+                else
+                {
+                    entry = &m_entries[0];
+                    for (size_t i = 1; i < N; i++)
+                        if (m_entries[i].heard < entry->heard)
+                            entry = &m_entries[i];
+                }
+                entry->sender = sender;
+            }
+            entry->ack = ack;
+            entry->heard = ++m_clock;
+        }
+    };
+} // namespace udp
+#endif